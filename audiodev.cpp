@@ -1,22 +1,46 @@
 #include <Python.h>
 #include <structmember.h>
+#include <math.h>
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#ifndef _WIN32
+#include "audiorecord.h"
+#endif
 
 #include "RtAudio.h"
+#include "audiolevel.h"
 
 extern "C" {
     PyMODINIT_FUNC initaudiodev(void);
 }
 
 
+/* Constructing RtAudio probes the audio subsystem, which is slow and fails on hosts without
+   sound. Hence it is created on first use instead of at import. */
 RtAudio *_rtaudio = 0;
 static PyObject *ModuleError;
 
+static RtAudio*
+getRtAudio()
+{
+    if (_rtaudio == 0) {
+        _rtaudio = new RtAudio();
+    }
+    return _rtaudio;
+}
+
 
 struct callback_data_t {
     PyObject* callback;
     PyObject* userdata;
     int input_size;
     int output_size;
+    int format;
+    int sample_rate;
+    unsigned int buffer_frames;
 };
 
 static callback_data_t callback_data;
@@ -26,7 +50,7 @@ static PyObject*
 pyaudio_get_api_name(PyObject* self, PyObject* args)
 {
     try {
-        RtAudio::Api api = _rtaudio->getCurrentApi();
+        RtAudio::Api api = getRtAudio()->getCurrentApi();
         const char* value = "unspecified";
         if (api == RtAudio::LINUX_ALSA)
             value = "linux-alsa";
@@ -50,6 +74,19 @@ pyaudio_get_api_name(PyObject* self, PyObject* args)
     }
 }
 
+static const char* api_names[] = {"alsa", "oss", "jack", "core", "asio", "ds", "dummy"};
+static RtAudio::Api api_codes[] = {RtAudio::LINUX_ALSA, RtAudio::LINUX_OSS, RtAudio::UNIX_JACK, RtAudio::MACOSX_CORE,
+    RtAudio::WINDOWS_ASIO, RtAudio::WINDOWS_DS, RtAudio::RTAUDIO_DUMMY};
+
+static int string2api(const char* str)
+{
+    for (unsigned i=0; i<sizeof(api_codes)/sizeof(api_codes[0]); ++i) {
+        if (strcmp(str, api_names[i]) == 0)
+            return api_codes[i];
+    }
+    return -1;
+}
+
 static const char* names[]= {"l8", "l16", "l24", "l32", "f32", "f64"};
 static int codes[] = {RTAUDIO_SINT8, RTAUDIO_SINT16, RTAUDIO_SINT24, RTAUDIO_SINT32, RTAUDIO_FLOAT32, RTAUDIO_FLOAT64};
 
@@ -114,30 +151,99 @@ device2object(const RtAudio::DeviceInfo& info)
 
 static const unsigned int invalid_device = (unsigned int) -1;
 
+/* Probing a device may open it (e.g., on ALSA), which is slow. Hence the
+   device table is probed once and cached, with name to id index, until
+   explicitly refreshed or a name lookup misses. */
+static std::vector<RtAudio::DeviceInfo> device_cache;
+static std::map<std::string, unsigned int> device_index;
+static bool device_cache_valid = false;
+
+static void
+refreshDevices()
+{
+    device_cache.clear();
+    device_index.clear();
+    device_cache_valid = false;
+    
+    unsigned device_count = getRtAudio()->getDeviceCount();
+    device_cache.reserve(device_count);
+    for (unsigned i=0; i<device_count; ++i) {
+        device_cache.push_back(getRtAudio()->getDeviceInfo(i));
+        const RtAudio::DeviceInfo& info = device_cache.back();
+        if (info.probed && device_index.find(info.name) == device_index.end()) {
+            device_index[info.name] = i;
+        }
+    }
+    device_cache_valid = true;
+}
+
+static const std::vector<RtAudio::DeviceInfo>&
+getDevices(bool refresh)
+{
+    if (refresh || !device_cache_valid) {
+        refreshDevices();
+    }
+    return device_cache;
+}
+
+/* Switch to the given audio API, which must be compiled in, unless it is already in use. */
+static bool
+selectApi(RtAudio::Api api)
+{
+    if (_rtaudio != 0 && _rtaudio->getCurrentApi() == api) {
+        return true;
+    }
+    std::vector<RtAudio::Api> compiled;
+    RtAudio::getCompiledApi(compiled);
+    if (std::find(compiled.begin(), compiled.end(), api) == compiled.end()) {
+        PyErr_SetString(ModuleError, "audio api is not supported in this build");
+        return false;
+    }
+    if (_rtaudio != 0 && _rtaudio->isStreamOpen()) {
+        PyErr_SetString(ModuleError, "cannot change the audio api while a stream is open");
+        return false;
+    }
+    try {
+        RtAudio* rtaudio = new RtAudio(api);
+        delete _rtaudio;
+        _rtaudio = rtaudio;
+        device_cache_valid = false;
+        return true;
+    } catch (RtError& e) {
+        PyErr_SetString(ModuleError, e.what());
+        return false;
+    }
+}
+
 static unsigned int
 deviceName2Id(const std::string& name, bool is_input)
 {
     try {
         if (name == "default") {
             if (is_input) {
-                return _rtaudio->getDefaultInputDevice();
+                return getRtAudio()->getDefaultInputDevice();
             }
             else {
-                return _rtaudio->getDefaultOutputDevice();
+                return getRtAudio()->getDefaultOutputDevice();
             }
         }
         
-        unsigned device_count = _rtaudio->getDeviceCount();
-        for (unsigned i=0; i<device_count; ++i) {
-            RtAudio::DeviceInfo info = _rtaudio->getDeviceInfo(i);
-            if (info.probed && info.name == name) {
-                return i;
-            }
+        // rescan once on a miss, in case the device was plugged in later
+        bool rescanned = !device_cache_valid;
+        getDevices(false);
+        std::map<std::string, unsigned int>::const_iterator it = device_index.find(name);
+        if (it == device_index.end() && !rescanned) {
+            getDevices(true);
+            it = device_index.find(name);
+        }
+        if (it != device_index.end()) {
+            return it->second;
         }
         
         PyErr_SetString(ModuleError, "device name not found");
         return invalid_device;
     } catch (RtError& e) {
+        device_cache_valid = false;
         PyErr_SetString(ModuleError, e.what());
         return invalid_device;
     }
@@ -145,24 +251,155 @@ deviceName2Id(const std::string& name, bool is_input)
 
 
 static PyObject*
-pyaudio_get_devices(PyObject* self, PyObject* args)
+pyaudio_get_devices(PyObject* self, PyObject* args, PyObject* kwargs)
 {
+    int probe = 0;
+    
+    static const char *kwlist[] = {
+        "probe",
+    NULL};
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|i", (char **)kwlist, &probe)) {
+        return NULL;
+    }
+    
     try {
-        unsigned device_count = _rtaudio->getDeviceCount();
-        PyObject *result = PyTuple_New(device_count);
+        const std::vector<RtAudio::DeviceInfo>& devices = getDevices(probe != 0);
+        PyObject *result = PyTuple_New(devices.size());
         
-        for (unsigned i=0; i<device_count; ++i) {
-            RtAudio::DeviceInfo info = _rtaudio->getDeviceInfo(i);
-            PyObject *dev = device2object(info);
+        for (unsigned i=0; i<devices.size(); ++i) {
+            PyObject *dev = device2object(devices[i]);
             PyTuple_SetItem(result, i, dev);
         }
         return Py_BuildValue("N", result);
     } catch (RtError& e) {
+        device_cache_valid = false;
         PyErr_SetString(ModuleError, e.what());
         return NULL;
     }
 }
 
+static PyObject*
+pyaudio_refresh_devices(PyObject* self, PyObject* unused)
+{
+    try {
+        getDevices(true);
+        return Py_BuildValue("i", (int) device_cache.size());
+    } catch (RtError& e) {
+        device_cache_valid = false;
+        PyErr_SetString(ModuleError, e.what());
+        return NULL;
+    }
+}
+
+
+/* Levels of the input and output of an "l16" stream, measured in the audio callback while it
+   holds the GIL, and aggregated only when read by get_levels. */
+static LevelMeter input_meter, output_meter;
+static int meter_window = 0;
+static double meter_silence = -50.0;
+
+static void
+meter_reset()
+{
+    bool linear = callback_data.format == RTAUDIO_SINT16;
+    level_init(&input_meter, linear ? callback_data.input_size / 2 : 0, meter_window > 0 ? meter_window : 1, meter_silence);
+    level_init(&output_meter, linear ? callback_data.output_size / 2 : 0, meter_window > 0 ? meter_window : 1, meter_silence);
+}
+
+#ifndef _WIN32
+
+/* Recording tap of the stream, e.g., for call recording. The callback copies the input and
+   output frames in the recording ring, while holding the GIL, and its writer thread drains the
+   ring to a WAV file. The callback never waits for the disk, and drops the frames that do not
+   fit in the ring instead. */
+
+#define RECORD_CHUNK (64 * 1024)
+#define RECORD_FILE_BUFFER (1 << 20)
+
+struct recorder_t {
+    bool active;
+    FILE* file;
+    RecordRing ring;
+    std::vector<char> frame;   // one interleaved input and output buffer
+    std::vector<char> buffer;  // stdio buffer of the file
+    int input_channels;
+    int output_channels;
+    int sample_rate;
+    unsigned long frames;
+    unsigned long dropped;
+    bool failed;
+};
+
+static recorder_t recorder;
+
+/* Write a chunk drained from the ring, on the writer thread. */
+static void
+recorder_write(void* context, char* data, size_t size)
+{
+    if (fwrite(data, 1, size, recorder.file) != size)
+        recorder.failed = true;
+}
+
+/* Called from the audio callback with the GIL, which serializes it with start and stop. The
+   output channels are recorded as silence if output_buffer is NULL, i.e., not filled. */
+static void
+recorder_tap(const void* input_buffer, const void* output_buffer, unsigned int buffer_frames)
+{
+    int channels = recorder.input_channels + recorder.output_channels;
+    size_t size = buffer_frames * channels * 2;
+    if (size > recorder.frame.size()) {
+        recorder.dropped += buffer_frames;
+        return;
+    }
+    
+    short* frame = (short*) &recorder.frame[0];
+    const short* input = (const short*) input_buffer;
+    const short* output = (const short*) output_buffer;
+    for (unsigned int i=0; i<buffer_frames; ++i) {
+        for (int c=0; c<recorder.input_channels; ++c)
+            *frame++ = input[i * recorder.input_channels + c];
+        for (int c=0; c<recorder.output_channels; ++c)
+            *frame++ = output != NULL ? output[i * recorder.output_channels + c] : 0;
+    }
+    
+    if (record_ring_put(&recorder.ring, &recorder.frame[0], size))
+        recorder.frames += buffer_frames;
+    else
+        recorder.dropped += buffer_frames;
+}
+
+static PyObject*
+recorder_stats()
+{
+    return Py_BuildValue("{sksk}", "frames", recorder.frames, "dropped", recorder.dropped);
+}
+
+/* Stop the writer after it drains the ring, and complete the file. */
+static bool
+recorder_stop()
+{
+    if (!recorder.active) {
+        return true;
+    }
+    recorder.active = false;
+    __sync_synchronize();
+    Py_BEGIN_ALLOW_THREADS
+    record_ring_stop(&recorder.ring);
+    Py_END_ALLOW_THREADS
+    
+    unsigned int data_size = recorder.ring.tail;
+    fseek(recorder.file, 0, SEEK_SET);
+    record_wav_header(recorder.file, recorder.sample_rate, recorder.input_channels + recorder.output_channels, data_size);
+    bool failed = fclose(recorder.file) != 0 || recorder.failed;
+    recorder.file = NULL;
+    std::vector<char>().swap(recorder.frame);
+    std::vector<char>().swap(recorder.buffer);
+    return !failed;
+}
+
+#endif
+
 
 static int
 inout(void *output_buffer, void *input_buffer, unsigned int buffer_frames,
@@ -187,6 +424,7 @@ inout(void *output_buffer, void *input_buffer, unsigned int buffer_frames,
     Py_XDECREF(input);
     Py_XDECREF(arglist);
     
+    bool filled = false;
     if (output != NULL) {
         if (PyString_Check(output)) {
             unsigned int new_size = PyString_Size(output);
@@ -195,9 +433,23 @@ inout(void *output_buffer, void *input_buffer, unsigned int buffer_frames,
             } else {
                 memset(output_buffer, 0, output_size);
             }
+            filled = true;
         }        
         Py_DECREF(output);
     }
+    if (meter_window > 0) {
+        if (input_meter.channels > 0)
+            level_update(&input_meter, (const short*) input_buffer, buffer_frames * input_meter.channels);
+        // the output buffer is left as is, and not measured, if the callback failed
+        if (output_meter.channels > 0 && filled)
+            level_update(&output_meter, (const short*) output_buffer, buffer_frames * output_meter.channels);
+    }
+#ifndef _WIN32
+    if (recorder.active) {
+        // like the meter, the output buffer is not recorded if the callback failed
+        recorder_tap(input_buffer, filled ? output_buffer : NULL, buffer_frames);
+    }
+#endif
     /* Release the thread. No Python API allowed beyond this point. */
     PyGILState_Release(gstate);
     
@@ -214,6 +466,7 @@ pyaudio_open(PyObject* self, PyObject* args, PyObject* kwargs)
     const char* format_str = "l16";
     int sample_rate = 16000;
     PyObject* callback = NULL, *userdata = Py_None;
+    const char* api = NULL;
     
     const char* input_device = NULL, *output_device = NULL;
     const unsigned int invalid_device = (unsigned int) -1;
@@ -223,16 +476,27 @@ pyaudio_open(PyObject* self, PyObject* args, PyObject* kwargs)
     static const char *kwlist[] = {
         "callback", "output", "output_channels", "input", "input_channels", 
         "format", "sample_rate", "frame_duration", "userdata",
-        "flags", "number_of_buffers", "priority",
+        "flags", "number_of_buffers", "priority", "api",
     NULL};
     
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|zizisiiOiii", (char **)kwlist,
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|zizisiiOiiiz", (char **)kwlist,
             &callback, &output_device, &output.nChannels, &input_device, &input.nChannels,
             &format_str, &sample_rate, &frame_duration, &userdata,
-            &options.flags, &options.numberOfBuffers, &options.priority)) {
+            &options.flags, &options.numberOfBuffers, &options.priority, &api)) {
         return NULL;
     }
     
+    if (api != NULL) {
+        int code = string2api(api);
+        if (code < 0) {
+            PyErr_SetString(ModuleError, "invalid api, must be one of \"alsa\", \"oss\", \"jack\", \"core\", \"asio\", \"ds\", \"dummy\"");
+            return NULL;
+        }
+        if (!selectApi((RtAudio::Api) code)) {
+            return NULL;
+        }
+    }
+    
     unsigned int buffer_frames = frame_duration * sample_rate / 1000;
     
     if (input_device != NULL) {
@@ -262,6 +526,9 @@ pyaudio_open(PyObject* self, PyObject* args, PyObject* kwargs)
     // update the callback structure
     callback_data.input_size = (input.deviceId != invalid_device ? format2size(format) * input.nChannels : 0);
     callback_data.output_size = (output.deviceId != invalid_device ? format2size(format) * output.nChannels : 0);
+    callback_data.format = format;
+    callback_data.sample_rate = sample_rate;
+    meter_reset();
     
     Py_XDECREF(callback_data.callback);
     Py_XINCREF(callback);
@@ -272,9 +539,10 @@ pyaudio_open(PyObject* self, PyObject* args, PyObject* kwargs)
     callback_data.userdata = userdata;
     
     try {
-        _rtaudio->openStream(output.deviceId != invalid_device ? &output : NULL,
-                             input.deviceId != invalid_device ? &input : NULL,
-                             format, sample_rate, &buffer_frames, &inout, NULL, &options);
+        getRtAudio()->openStream(output.deviceId != invalid_device ? &output : NULL,
+                                 input.deviceId != invalid_device ? &input : NULL,
+                                 format, sample_rate, &buffer_frames, &inout, NULL, &options);
+        callback_data.buffer_frames = buffer_frames;
         _rtaudio->startStream();
     } catch (RtError& e) {
         PyErr_SetString(ModuleError, e.what());
@@ -292,15 +560,20 @@ pyaudio_open(PyObject* self, PyObject* args, PyObject* kwargs)
 static PyObject*
 pyaudio_close(PyObject* self, PyObject* unused)
 {
-    try {
-        _rtaudio->stopStream();
-    } catch (const RtError& e) {
-        // ignore
-    }
-    try {
-        _rtaudio->closeStream();
-    } catch (const RtError& e) {
-        // ignore
+#ifndef _WIN32
+    recorder_stop();
+#endif
+    if (_rtaudio != 0) {
+        try {
+            _rtaudio->stopStream();
+        } catch (const RtError& e) {
+            // ignore
+        }
+        try {
+            _rtaudio->closeStream();
+        } catch (const RtError& e) {
+            // ignore
+        }
     }
     Py_XDECREF(callback_data.callback);
     Py_XDECREF(callback_data.userdata);
@@ -314,6 +587,9 @@ pyaudio_close(PyObject* self, PyObject* unused)
 static PyObject*
 pyaudio_is_open(PyObject* self, PyObject* unused)
 {
+    if (_rtaudio == 0) {
+        return Py_BuildValue("i", 0);
+    }
     try {
         return Py_BuildValue("i", _rtaudio->isStreamOpen());
     } catch (const RtError& e) {
@@ -325,6 +601,10 @@ pyaudio_is_open(PyObject* self, PyObject* unused)
 static PyObject*
 pyaudio_get_stream_time(PyObject* self, PyObject* unused)
 {
+    if (_rtaudio == 0) {
+        PyErr_SetString(ModuleError, "audio stream is not open");
+        return NULL;
+    }
     try {
         return Py_BuildValue("d", _rtaudio->getStreamTime());
     } catch (const RtError& e) {
@@ -336,6 +616,10 @@ pyaudio_get_stream_time(PyObject* self, PyObject* unused)
 static PyObject*
 pyaudio_get_stream_latency(PyObject* self, PyObject* args)
 {
+    if (_rtaudio == 0) {
+        PyErr_SetString(ModuleError, "audio stream is not open");
+        return NULL;
+    }
     try {
         return Py_BuildValue("i", _rtaudio->getStreamLatency());
     } catch (const RtError& e) {
@@ -347,6 +631,10 @@ pyaudio_get_stream_latency(PyObject* self, PyObject* args)
 static PyObject*
 pyaudio_get_stream_sample_rate(PyObject* self, PyObject* args)
 {
+    if (_rtaudio == 0) {
+        PyErr_SetString(ModuleError, "audio stream is not open");
+        return NULL;
+    }
     try {
         return Py_BuildValue("i", _rtaudio->getStreamSampleRate());
     } catch (const RtError& e) {
@@ -355,19 +643,135 @@ pyaudio_get_stream_sample_rate(PyObject* self, PyObject* args)
     }
 }
 
+static PyObject*
+pyaudio_set_meter(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+    int window = 50;
+    double silence = -50.0;
+    
+    static const char *kwlist[] = {
+        "window", "silence",
+    NULL};
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|id", (char **)kwlist, &window, &silence)) {
+        return NULL;
+    }
+    if (window < 0) {
+        PyErr_SetString(ModuleError, "invalid window, must not be negative");
+        return NULL;
+    }
+    meter_window = window;
+    meter_silence = silence;
+    meter_reset();
+    
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject*
+pyaudio_get_levels(PyObject* self, PyObject* unused)
+{
+    return Py_BuildValue("{sNsN}", "input", level_object(&input_meter), "output", level_object(&output_meter));
+}
+
+#ifndef _WIN32
+
+static PyObject*
+pyaudio_record_start(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+    const char* path = NULL;
+    int ring_duration = 2000; // in milliseconds
+    
+    static const char *kwlist[] = {
+        "path", "ring_duration",
+    NULL};
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|i", (char **)kwlist, &path, &ring_duration)) {
+        return NULL;
+    }
+    
+    if (_rtaudio == 0 || !_rtaudio->isStreamOpen()) {
+        PyErr_SetString(ModuleError, "audio stream is not open");
+        return NULL;
+    }
+    if (callback_data.format != RTAUDIO_SINT16) {
+        PyErr_SetString(ModuleError, "recording requires the stream format \"l16\"");
+        return NULL;
+    }
+    if (recorder.active) {
+        PyErr_SetString(ModuleError, "recording is already started");
+        return NULL;
+    }
+    if (ring_duration < 100) {
+        PyErr_SetString(ModuleError, "invalid ring_duration, must be at least 100 ms");
+        return NULL;
+    }
+    
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        PyErr_SetString(ModuleError, "cannot create the recording file");
+        return NULL;
+    }
+    
+    recorder.input_channels = callback_data.input_size / 2;
+    recorder.output_channels = callback_data.output_size / 2;
+    recorder.sample_rate = callback_data.sample_rate;
+    int frame_size = (recorder.input_channels + recorder.output_channels) * 2;
+    recorder.frame.resize(callback_data.buffer_frames * frame_size);
+    recorder.buffer.resize(RECORD_FILE_BUFFER);
+    recorder.frames = recorder.dropped = 0;
+    recorder.failed = false;
+    recorder.file = file;
+    setvbuf(file, &recorder.buffer[0], _IOFBF, recorder.buffer.size());
+    record_wav_header(file, recorder.sample_rate, recorder.input_channels + recorder.output_channels, 0);
+    
+    if (record_ring_start(&recorder.ring, (size_t) recorder.sample_rate * ring_duration / 1000 * frame_size,
+                          RECORD_CHUNK, recorder_write, NULL) != 0) {
+        fclose(file);
+        recorder.file = NULL;
+        PyErr_SetString(ModuleError, "cannot create the recording thread");
+        return NULL;
+    }
+    recorder.active = true;
+    
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject*
+pyaudio_record_stop(PyObject* self, PyObject* unused)
+{
+    if (!recorder_stop()) {
+        PyErr_SetString(ModuleError, "failed to write the recording file");
+        return NULL;
+    }
+    return recorder_stats();
+}
+
+static PyObject*
+pyaudio_record_stats(PyObject* self, PyObject* unused)
+{
+    return recorder_stats();
+}
+
+#endif
 
 
 static PyMethodDef Module_methods[] = {
     {"get_api_name", (PyCFunction) pyaudio_get_api_name, METH_NOARGS,
         PyDoc_STR("get_api_name() -> name:str\n\n"
-            "Get the currently used audio API name")},
-    {"get_devices", (PyCFunction) pyaudio_get_devices, METH_NOARGS,
-        PyDoc_STR("get_devices() -> (object1, object2, ...)\n\n"
-            "Get the list of available audio devices and their properties."
-            "Each object in the returned sequence is a dict with keys \"name\", \"sample_rates\", \"input_channels\", \"output_channels\", etc.")},
+            "Get the currently used audio API name, initializing the default API if none is used yet")},
+    {"get_devices", (PyCFunction) pyaudio_get_devices, METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("get_devices(probe=False) -> (object1, object2, ...)\n\n"
+            "Get the list of available audio devices and their properties. "
+            "Each object in the returned sequence is a dict with keys \"name\", \"sample_rates\", \"input_channels\", \"output_channels\", etc.\n"
+            " probe - if set, probe all the devices again instead of returning the cached device table")},
+    {"refresh_devices", (PyCFunction) pyaudio_refresh_devices, METH_NOARGS,
+        PyDoc_STR("refresh_devices() -> count:int\n\n"
+            "Probe all the devices again to refresh the cached device table, e.g., after a device is plugged in or removed")},
         
     {"open", (PyCFunction) pyaudio_open, METH_VARARGS | METH_KEYWORDS,
-        PyDoc_STR("open(callback, output=None, output_channels=1, input=None, input_channels=1, format=\"l16\", sample_rate=16000, frame_duration=20, userdata=None, flags=0, number_of_buffers=0, priority=0)\n\n"
+        PyDoc_STR("open(callback, output=None, output_channels=1, input=None, input_channels=1, format=\"l16\", sample_rate=16000, frame_duration=20, userdata=None, flags=0, number_of_buffers=0, priority=0, api=None)\n\n"
             "Open the audio device stream and start calling the callback to exchange audio fragments.\n"
             " callback - a function that is called to exchange audio data as callback(mic_data:str, stream_time:float, userdata) -> spkr_data:str\n"
             " output - name of output device or \"default\" to open audio output device\n"
@@ -377,6 +781,8 @@ static PyMethodDef Module_methods[] = {
             " format - format for audio samples is one of \"l8\", \"l16\", \"l24\", \"l32\", \"f32\", \"f64\" for various int and float values\n"
             " sample_rate - sampling rate to use for audio stream in Hz.\n"
             " frame_duration - frame duration for capture and playback in ms\n"
+            " api - optional audio API to use, one of \"alsa\", \"oss\", \"jack\", \"core\", \"asio\", \"ds\", \"dummy\", "
+            "default is the first available, which also applies to the device names\n"
             " other parameters are not recommended to be changed")},
     {"close", (PyCFunction) pyaudio_close, METH_NOARGS,
         PyDoc_STR("close()\n\n"
@@ -395,6 +801,31 @@ static PyMethodDef Module_methods[] = {
         PyDoc_STR("get_stream_sample_rate() -> int\n\n"
             "Get the sample rate used for opening the audio stream")},
         
+    {"set_meter", (PyCFunction) pyaudio_set_meter, METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("set_meter(window=50, silence=-50.0)\n\n"
+            "Measure the levels of the input and output channels of \"l16\" streams in the audio callback.\n"
+            " window - number of most recent callbacks aggregated by get_levels, or 0 to stop measuring\n"
+            " silence - level in dBFS below which a callback's frames count as silent")},
+    {"get_levels", (PyCFunction) pyaudio_get_levels, METH_NOARGS,
+        PyDoc_STR("get_levels() -> {\"input\": (channel1, ...), \"output\": (channel1, ...)}\n\n"
+            "Get the levels over the window, as a dict per channel with rms and peak in sample units, the number of "
+            "clipped samples, the silence ratio of the callbacks, and the number of callbacks in the window")},
+#ifndef _WIN32
+    {"record_start", (PyCFunction) pyaudio_record_start, METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("record_start(path, ring_duration=2000)\n\n"
+            "Start recording the open \"l16\" stream to a WAV file, with the input channels followed by the output channels in each frame. "
+            "The audio callback only copies the frames to a ring, which a background thread writes to the file.\n"
+            " path - name of the WAV file to create\n"
+            " ring_duration - duration of the ring in ms, beyond which the frames are dropped if the disk falls behind")},
+    {"record_stop", (PyCFunction) pyaudio_record_stop, METH_NOARGS,
+        PyDoc_STR("record_stop() -> dict\n\n"
+            "Stop recording after writing all the queued frames, and return the recorded and dropped frame counts. "
+            "Closing the stream also stops recording")},
+    {"record_stats", (PyCFunction) pyaudio_record_stats, METH_NOARGS,
+        PyDoc_STR("record_stats() -> dict\n\n"
+            "Get the number of recorded frames, and the number of frames dropped because the ring was full")},
+#endif
+        
     {NULL, NULL, 0, NULL}  /* Sentinel */
 };
 
@@ -412,8 +843,6 @@ initaudiodev(void)
     if (m == NULL)
         return;
 
-    _rtaudio = new RtAudio();
-    
     ModuleError = PyErr_NewException("audiodev.error", NULL, NULL);
     Py_INCREF(ModuleError);
     PyModule_AddObject(m, "error", ModuleError);
@@ -0,0 +1,109 @@
+/* Level metering of linear fragments per channel, shared by audiodev and audiospeex. Each
+   fragment is measured in a single pass and kept in a rolling window, which is aggregated only
+   when the levels are read. Include it after Python.h. */
+
+#ifndef AUDIOLEVEL_H
+#define AUDIOLEVEL_H
+
+#include <math.h>
+#include <vector>
+
+#define METER_FULL_SCALE 32767
+
+struct LevelStats {
+    double energy;
+    unsigned int samples;
+    int peak;
+    unsigned int clips;
+    bool silent;
+};
+
+struct LevelMeter {
+    int channels;
+    int window;                     // number of fragments in the window
+    double silence;                 // mean energy below which a fragment is silent
+    std::vector<LevelStats> stats;  // window rows of channels
+    size_t count;                   // number of fragments measured
+};
+
+static void
+level_init(LevelMeter* meter, int channels, int window, double silence_db)
+{
+    double silence = METER_FULL_SCALE * pow(10.0, silence_db / 20.0);
+    meter->channels = channels;
+    meter->window = window;
+    meter->silence = silence * silence;
+    meter->stats.assign(window * channels, LevelStats());
+    meter->count = 0;
+}
+
+static inline void
+level_measure(const short* samples, int frames, int stride, double silence, LevelStats* stats)
+{
+    long long energy = 0;
+    int peak = 0;
+    unsigned int clips = 0;
+    for (int i=0; i<frames; ++i) {
+        int value = samples[i * stride];
+        int magnitude = value < 0 ? -value : value;
+        energy += value * value;
+        peak = magnitude > peak ? magnitude : peak;
+        clips += magnitude >= METER_FULL_SCALE;
+    }
+    stats->energy = (double) energy;
+    stats->samples = frames;
+    stats->peak = peak;
+    stats->clips = clips;
+    stats->silent = energy < silence * frames;
+}
+
+/* Measure a fragment of interleaved samples, and return its RMS over all channels. */
+static double
+level_update(LevelMeter* meter, const short* samples, int count)
+{
+    int frames = count / meter->channels;
+    if (frames <= 0) {
+        return 0;
+    }
+    LevelStats* row = &meter->stats[(meter->count % meter->window) * meter->channels];
+    double energy = 0;
+    if (meter->channels == 1) {
+        level_measure(samples, frames, 1, meter->silence, row);
+        energy = row->energy;
+    }
+    else {
+        for (int c=0; c<meter->channels; ++c) {
+            level_measure(samples + c, frames, meter->channels, meter->silence, row + c);
+            energy += row[c].energy;
+        }
+    }
+    meter->count++;
+    return sqrt(energy / (frames * meter->channels));
+}
+
+/* Aggregate the window as a tuple of per-channel dicts. */
+static PyObject*
+level_object(const LevelMeter* meter)
+{
+    int rows = meter->count < (size_t) meter->window ? (int) meter->count : meter->window;
+    PyObject* result = PyTuple_New(meter->channels);
+    for (int c=0; c<meter->channels; ++c) {
+        double energy = 0;
+        unsigned int samples = 0, clips = 0, silent = 0;
+        int peak = 0;
+        for (int i=0; i<rows; ++i) {
+            const LevelStats& stats = meter->stats[i * meter->channels + c];
+            energy += stats.energy;
+            samples += stats.samples;
+            clips += stats.clips;
+            silent += stats.silent ? 1 : 0;
+            peak = stats.peak > peak ? stats.peak : peak;
+        }
+        PyTuple_SET_ITEM(result, c, Py_BuildValue("{sdsisIsdsi}",
+            "rms", samples > 0 ? sqrt(energy / samples) : 0.0, "peak", peak, "clips", clips,
+            "silence", rows > 0 ? (double) silent / rows : 0.0, "fragments", rows));
+    }
+    return result;
+}
+
+#endif
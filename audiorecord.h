@@ -0,0 +1,134 @@
+/* Recording ring shared by the recording taps of audiodev and audiospeex. The producer copies
+   the samples in a lock-free single producer single consumer ring without blocking, and a
+   writer thread drains the ring in chunks, e.g., to a file with large buffered writes. None of
+   these functions use the Python API, and the caller must release the GIL around
+   record_ring_stop if the producer may need the GIL to finish. */
+
+#ifndef AUDIORECORD_H
+#define AUDIORECORD_H
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <vector>
+
+#define RECORD_POLL_INTERVAL 20000 // in microseconds
+
+/* Called on the writer thread with each chunk drained from the ring. */
+typedef void (*record_write_t)(void* context, char* data, size_t size);
+
+struct RecordRing {
+    std::vector<char> ring;
+    volatile size_t head;      // bytes written by the producer
+    volatile size_t tail;      // bytes consumed by the writer thread
+    volatile bool stopping;
+    pthread_t thread;
+    size_t chunk_size;
+    record_write_t write;
+    void* context;
+};
+
+static void*
+record_ring_run(void* arg)
+{
+    RecordRing* ring = (RecordRing*) arg;
+    std::vector<char> chunk(ring->chunk_size);
+    while (true) {
+        bool stopping = ring->stopping;
+        __sync_synchronize();
+        size_t head = ring->head;
+        __sync_synchronize();
+        size_t available = head - ring->tail;
+        if (available == 0) {
+            if (stopping)
+                break;
+            usleep(RECORD_POLL_INTERVAL);
+            continue;
+        }
+        size_t size = available < chunk.size() ? available : chunk.size();
+        size_t position = ring->tail % ring->ring.size();
+        size_t first = size < ring->ring.size() - position ? size : ring->ring.size() - position;
+        memcpy(&chunk[0], &ring->ring[position], first);
+        memcpy(&chunk[first], &ring->ring[0], size - first);
+        __sync_synchronize();
+        ring->tail += size;
+        ring->write(ring->context, &chunk[0], size);
+    }
+    return NULL;
+}
+
+/* Allocate the ring of size bytes and start its writer thread, which passes the drained data to
+   write in chunks of at most chunk_size bytes. Return 0, or the error of pthread_create. */
+static int
+record_ring_start(RecordRing* ring, size_t size, size_t chunk_size, record_write_t write, void* context)
+{
+    ring->ring.resize(size);
+    ring->head = ring->tail = 0;
+    ring->stopping = false;
+    ring->chunk_size = chunk_size;
+    ring->write = write;
+    ring->context = context;
+    int err = pthread_create(&ring->thread, NULL, record_ring_run, ring);
+    if (err != 0) {
+        std::vector<char>().swap(ring->ring);
+    }
+    return err;
+}
+
+/* Queue the data without blocking, or return false if the ring is full. */
+static bool
+record_ring_put(RecordRing* ring, const void* data, size_t size)
+{
+    size_t head = ring->head;
+    __sync_synchronize();
+    if (size > ring->ring.size() - (head - ring->tail)) {
+        return false;
+    }
+    size_t position = head % ring->ring.size();
+    size_t first = size < ring->ring.size() - position ? size : ring->ring.size() - position;
+    memcpy(&ring->ring[position], data, first);
+    memcpy(&ring->ring[0], (const char*) data + first, size - first);
+    __sync_synchronize();
+    ring->head = head + size;
+    return true;
+}
+
+/* Stop the writer thread after it drains the ring, and free the ring. */
+static void
+record_ring_stop(RecordRing* ring)
+{
+    __sync_synchronize();
+    ring->stopping = true;
+    pthread_join(ring->thread, NULL);
+    std::vector<char>().swap(ring->ring);
+}
+
+static void
+record_put_le(unsigned char* p, unsigned int value, int size)
+{
+    for (int i=0; i<size; ++i)
+        p[i] = (unsigned char) (value >> (8 * i));
+}
+
+/* Write the 44 byte header of a 16-bit linear WAV file. */
+static void
+record_wav_header(FILE* file, int sample_rate, int channels, unsigned int data_size)
+{
+    unsigned char header[44];
+    memcpy(header, "RIFF", 4);
+    record_put_le(header + 4, 36 + data_size, 4);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    record_put_le(header + 16, 16, 4);
+    record_put_le(header + 20, 1, 2);
+    record_put_le(header + 22, channels, 2);
+    record_put_le(header + 24, sample_rate, 4);
+    record_put_le(header + 28, sample_rate * channels * 2, 4);
+    record_put_le(header + 32, channels * 2, 2);
+    record_put_le(header + 34, 16, 2);
+    memcpy(header + 36, "data", 4);
+    record_put_le(header + 40, data_size, 4);
+    fwrite(header, 1, sizeof(header), file);
+}
+
+#endif
@@ -1,6 +1,30 @@
 #include <Python.h>
 #include <structmember.h>
+#include <math.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <map>
+#include <vector>
+#include "audiolevel.h"
+
+#ifdef __linux__
+#include <pthread.h>
+#include <stdint.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string>
+#include "audiorecord.h"
+#endif
 
 
 extern "C" {
@@ -8,6 +32,10 @@ extern "C" {
     #include "speex/speex_preprocess.h"
     #include "speex/speex_echo.h"
     #include "speex/speex_resampler.h"
+    #include "speex/speex_header.h"
+#ifdef HAVE_OPUS
+    #include "opus/opus.h"
+#endif
     
     PyMODINIT_FUNC initaudiospeex(void);
 }
@@ -20,7 +48,27 @@ enum {
     TYPE_DECODER,
     TYPE_RESAMPLER,
     TYPE_PREPROCESS,
-    TYPE_ECHO
+    TYPE_ECHO,
+    TYPE_OPUS_ENCODER,
+    TYPE_OPUS_DECODER,
+    TYPE_DRIFT,
+    TYPE_RECORDER,
+    TYPE_METER
+};
+
+struct ResamplerBank;
+struct Recorder;
+
+struct DriftBuffer {
+    std::vector<short> samples;
+    size_t head;
+    int input_rate;
+    int output_rate;
+    int target;
+    int max_latency;
+    double depth_average;
+    double integral;
+    int adjust;
 };
 
 typedef struct {
@@ -31,34 +79,197 @@ typedef struct {
     SpeexBits bits;
     unsigned int input_size;
     unsigned int output_size;
+    int sample_rate;
+    int channels;
+    int frame_size;
+    int payload_type;
+    unsigned int rtp_ssrc;
+    unsigned int rtp_timestamp;
+    unsigned short rtp_sequence;
+    int rtp_marker;
+    unsigned int rtp_received;
+    unsigned int rtp_lost;
+    unsigned int rtp_late;
+    int rtp_started;
+    ResamplerBank* bank;
+    int channel;
+    int filter_length;
+    int application;
+    DriftBuffer* drift;
+    unsigned int drift_underruns;
+    unsigned int drift_overruns;
+    double drift_adjustment;
+    Recorder* recorder;
+    unsigned int record_frames;
+    unsigned int record_dropped;
+    LevelMeter* level;
 } State;
 
+/* Idle codec states, kept reset for reuse by new states with the same type and parameters,
+   instead of being destroyed and initialized again on every call setup. */
+static std::map<unsigned long long, std::vector<void*> > state_pool;
+static unsigned int pool_max_idle = 0;
+static unsigned long pool_hits = 0, pool_misses = 0, pool_returns = 0, pool_discards = 0;
+
+static unsigned long long
+pool_key(int type, int a, int b)
+{
+    return ((unsigned long long) type << 56) | ((unsigned long long) (a & 0xfffffff) << 28) | (b & 0xfffffff);
+}
+
+static void
+pool_destroy(int type, void* value)
+{
+    switch (type) {
+    case TYPE_ENCODER:
+        speex_encoder_destroy(value);
+        break;
+    case TYPE_DECODER:
+        speex_decoder_destroy(value);
+        break;
+    case TYPE_RESAMPLER:
+    case TYPE_DRIFT:
+        speex_resampler_destroy((SpeexResamplerState*) value);
+        break;
+    case TYPE_PREPROCESS:
+        speex_preprocess_state_destroy((SpeexPreprocessState*) value);
+        break;
+    case TYPE_ECHO:
+        speex_echo_state_destroy((SpeexEchoState*) value);
+        break;
+#ifdef HAVE_OPUS
+    case TYPE_OPUS_ENCODER:
+        opus_encoder_destroy((OpusEncoder*) value);
+        break;
+    case TYPE_OPUS_DECODER:
+        opus_decoder_destroy((OpusDecoder*) value);
+        break;
+#endif
+    }
+}
+
+static void*
+pool_get(int type, int a, int b)
+{
+    if (pool_max_idle == 0) {
+        return NULL;
+    }
+    std::map<unsigned long long, std::vector<void*> >::iterator it = state_pool.find(pool_key(type, a, b));
+    if (it == state_pool.end() || it->second.empty()) {
+        pool_misses++;
+        return NULL;
+    }
+    void* value = it->second.back();
+    it->second.pop_back();
+    pool_hits++;
+    return value;
+}
+
+/* Reset and keep the value if there is room in the pool, otherwise return false. */
+static bool
+pool_put(int type, int a, int b, void* value)
+{
+    if (pool_max_idle == 0) {
+        return false;
+    }
+    std::vector<void*>& idle = state_pool[pool_key(type, a, b)];
+    if (idle.size() >= pool_max_idle) {
+        pool_discards++;
+        return false;
+    }
+    
+    switch (type) {
+    case TYPE_ENCODER:
+        speex_encoder_ctl(value, SPEEX_RESET_STATE, NULL);
+        break;
+    case TYPE_DECODER:
+        speex_decoder_ctl(value, SPEEX_RESET_STATE, NULL);
+        break;
+    case TYPE_ECHO:
+        speex_echo_state_reset((SpeexEchoState*) value);
+        break;
+#ifdef HAVE_OPUS
+    case TYPE_OPUS_ENCODER:
+        opus_encoder_ctl((OpusEncoder*) value, OPUS_RESET_STATE);
+        break;
+    case TYPE_OPUS_DECODER:
+        opus_decoder_ctl((OpusDecoder*) value, OPUS_RESET_STATE);
+        break;
+#endif
+    default:
+        // the preprocessor has no way to reset its adapted state, so only fresh ones from pool_warm are pooled
+        return false;
+    }
+    idle.push_back(value);
+    pool_returns++;
+    return true;
+}
+
+static const SpeexMode*
+speex_mode(int sample_rate)
+{
+    return sample_rate == 8000 ? &speex_nb_mode : (sample_rate == 16000 ? &speex_wb_mode : &speex_uwb_mode);
+}
+
+static void*
+speex_codec_create(int type, int sample_rate)
+{
+    void* value = pool_get(type, sample_rate, 0);
+    if (value == NULL) {
+        value = type == TYPE_ENCODER ? speex_encoder_init(speex_mode(sample_rate)) : speex_decoder_init(speex_mode(sample_rate));
+    }
+    return value;
+}
+
+static void resampler_bank_release(ResamplerBank* bank, int channel);
+#ifdef __linux__
+static bool recorder_close(Recorder* recorder);
+#endif
+
 static void
 State_dealloc(State* self)
 {
     if (self->value) {
+        bool pooled = false;
         switch (self->type) {
         case TYPE_ENCODER:
-            speex_encoder_destroy(self->value);
-            break;
         case TYPE_DECODER:
-            speex_decoder_destroy(self->value);
+            pooled = pool_put(self->type, self->sample_rate, 0, self->value);
             break;
-        case TYPE_RESAMPLER:
-            speex_resampler_destroy((SpeexResamplerState*) self->value);
+        case TYPE_ECHO:
+            pooled = pool_put(self->type, self->frame_size, self->filter_length, self->value);
             break;
-        case TYPE_PREPROCESS:
-            speex_preprocess_state_destroy((SpeexPreprocessState*)self->value);
+        case TYPE_OPUS_ENCODER:
+            pooled = pool_put(self->type, self->sample_rate, self->channels + 4 * self->application, self->value);
             break;
-        case TYPE_ECHO:
-            speex_echo_state_destroy((SpeexEchoState*)self->value);
+        case TYPE_OPUS_DECODER:
+            pooled = pool_put(self->type, self->sample_rate, self->channels, self->value);
+            break;
+        case TYPE_RESAMPLER:
+            if (self->bank) {
+                resampler_bank_release(self->bank, self->channel);
+                pooled = true;
+            }
             break;
         }
+        if (!pooled) {
+            pool_destroy(self->type, self->value);
+        }
         self->value = NULL;
     }
-    if (self->type == TYPE_ENCODER || self->type == TYPE_DECODER) {
-        speex_bits_destroy(&self->bits);
+    delete self->drift;
+    delete self->level;
+#ifdef __linux__
+    if (self->recorder) {
+        // the writer thread may still be writing to the disk
+        Recorder* recorder = self->recorder;
+        self->recorder = NULL;
+        Py_BEGIN_ALLOW_THREADS
+        recorder_close(recorder);
+        Py_END_ALLOW_THREADS
     }
+#endif
+    speex_bits_destroy(&self->bits);
     
     //printf("------- destroyed codec context of type %d\n", self->type);
     self->ob_type->tp_free((PyObject*) self);
@@ -79,6 +290,23 @@ State_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
     return (PyObject *)self;
 }
 
+static PyMemberDef State_members[] = {
+    {(char*) "payload_type", T_INT, offsetof(State, payload_type), READONLY, (char*) "RTP payload type"},
+    {(char*) "ssrc", T_UINT, offsetof(State, rtp_ssrc), READONLY, (char*) "RTP synchronization source identifier"},
+    {(char*) "timestamp", T_UINT, offsetof(State, rtp_timestamp), READONLY, (char*) "RTP timestamp of the next sent or the last received packet"},
+    {(char*) "sequence", T_USHORT, offsetof(State, rtp_sequence), READONLY, (char*) "RTP sequence number of the next sent or the highest received packet"},
+    {(char*) "marker", T_INT, offsetof(State, rtp_marker), READONLY, (char*) "RTP marker bit of the last received packet"},
+    {(char*) "received", T_UINT, offsetof(State, rtp_received), READONLY, (char*) "number of RTP packets received"},
+    {(char*) "lost", T_UINT, offsetof(State, rtp_lost), READONLY, (char*) "number of RTP packets detected as lost from gaps in sequence numbers"},
+    {(char*) "late", T_UINT, offsetof(State, rtp_late), READONLY, (char*) "number of late or duplicate RTP packets received"},
+    {(char*) "underruns", T_UINT, offsetof(State, drift_underruns), READONLY, (char*) "number of drift_get calls padded with silence"},
+    {(char*) "overruns", T_UINT, offsetof(State, drift_overruns), READONLY, (char*) "number of drift_put calls that dropped samples over max_latency"},
+    {(char*) "adjustment", T_DOUBLE, offsetof(State, drift_adjustment), READONLY, (char*) "current drift compensation of the resampling ratio in ppm"},
+    {(char*) "recorded", T_UINT, offsetof(State, record_frames), READONLY, (char*) "number of frames queued for recording"},
+    {(char*) "dropped", T_UINT, offsetof(State, record_dropped), READONLY, (char*) "number of frames dropped because the recording ring was full"},
+    {NULL}  /* Sentinel */
+};
+
 
 static PyTypeObject StateType = {
     PyObject_HEAD_INIT(NULL)
@@ -110,7 +338,7 @@ static PyTypeObject StateType = {
     0,		               /* tp_iter */
     0,		               /* tp_iternext */
     0,                         /* tp_methods */
-    0,                         /* tp_members */
+    State_members,             /* tp_members */
     0,                         /* tp_getset */
     0,                         /* tp_base */
     0,                         /* tp_dict */
@@ -123,6 +351,273 @@ static PyTypeObject StateType = {
 };
 
 
+/* A fragment argument from any object supporting the buffer protocol, such as str,
+   bytearray, memoryview, mmap or array. Linear fragments may also be NumPy int16
+   arrays, or float32 arrays in [-1.0, 1.0), which are converted to int16. */
+class Fragment {
+public:
+    Fragment() : data(NULL), size(0), acquired(false) {}
+    ~Fragment() {
+        if (acquired)
+            PyBuffer_Release(&view);
+    }
+    
+    int parse(PyObject* obj, const char* name, bool linear);
+    short* samples() const { return (short*) data; }
+    Py_ssize_t count() const { return size / 2; }
+    
+    const char* data;
+    Py_ssize_t size;
+    
+private:
+    Py_buffer view;
+    bool acquired;
+    std::vector<short> converted;
+};
+
+/* Return 'h' for int16, 'f' for float32, 'B' for bytes, or 0 if not supported. */
+static char
+buffer_format(const char* format)
+{
+    static const unsigned short one = 1;
+    if (format == NULL)
+        return 'B';
+    if (*format == '@' || *format == '=' || (*format == '<' && *(const char*) &one == 1))
+        ++format;
+    if (strcmp(format, "h") == 0)
+        return 'h';
+    if (strcmp(format, "f") == 0)
+        return 'f';
+    if (strcmp(format, "B") == 0 || strcmp(format, "b") == 0 || strcmp(format, "c") == 0)
+        return 'B';
+    return 0;
+}
+
+int
+Fragment::parse(PyObject* obj, const char* name, bool linear)
+{
+    if (PyString_Check(obj)) {
+        data = PyString_AS_STRING(obj);
+        size = PyString_GET_SIZE(obj);
+        return 0;
+    }
+    if (!PyObject_CheckBuffer(obj)) {
+        // old style buffer, e.g., mmap or array in Python 2
+        const void* buffer = NULL;
+        if (PyObject_AsReadBuffer(obj, &buffer, &size) < 0) {
+            PyErr_Clear();
+            PyErr_Format(PyExc_TypeError, "invalid %s argument, must support the buffer protocol", name);
+            return -1;
+        }
+        data = (const char*) buffer;
+        return 0;
+    }
+    
+    if (PyObject_GetBuffer(obj, &view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0) {
+        return -1;
+    }
+    acquired = true;
+    data = (const char*) view.buf;
+    size = view.len;
+    
+    char format = buffer_format(view.format);
+    if (linear && format == 'f') {
+        Py_ssize_t count = view.len / 4;
+        const float* input = (const float*) view.buf;
+        converted.resize(count + 1);
+        for (Py_ssize_t i=0; i<count; ++i) {
+            float value = input[i] * 32768.0f;
+            if (value != value) // NaN
+                value = 0.0f;
+            converted[i] = (short) (value >= 32767.0f ? 32767 : (value <= -32768.0f ? -32768 : (int) value));
+        }
+        data = (const char*) &converted[0];
+        size = count * 2;
+    }
+    else if (linear && format != 'h' && format != 'B') {
+        PyErr_Format(PyExc_TypeError, "invalid %s argument, samples must be int16 or float32", name);
+        return -1;
+    }
+    return 0;
+}
+
+/* The result of a processing function, which is written in place in a new string, or in the
+   out buffer if given. The function writes at most capacity bytes at data, and finish returns
+   the string, or the size written to out. If the out buffer is smaller than capacity, or overlaps
+   the input fragments, the result is written to a temporary buffer and copied if it fits. */
+class Output {
+public:
+    Output() : data(NULL), result(NULL), buffer(NULL), buffer_size(0), acquired(false) {}
+    ~Output() {
+        if (acquired)
+            PyBuffer_Release(&view);
+        Py_XDECREF(result);
+    }
+    
+    int open(PyObject* out, Py_ssize_t capacity, const Fragment* input = NULL, const Fragment* other = NULL);
+    PyObject* finish(Py_ssize_t size);
+    
+    char* data;
+    
+private:
+    PyObject* result;
+    void* buffer;
+    Py_ssize_t buffer_size;
+    Py_buffer view;
+    bool acquired;
+    std::vector<char> temporary;
+};
+
+static bool
+overlaps(const void* buffer, Py_ssize_t buffer_size, const Fragment* fragment)
+{
+    return fragment != NULL && (const char*) buffer < fragment->data + fragment->size
+        && fragment->data < (const char*) buffer + buffer_size;
+}
+
+int
+Output::open(PyObject* out, Py_ssize_t capacity, const Fragment* input, const Fragment* other)
+{
+    if (out == NULL || out == Py_None) {
+        result = PyString_FromStringAndSize(NULL, capacity);
+        if (result == NULL)
+            return -1;
+        data = PyString_AS_STRING(result);
+        return 0;
+    }
+    
+    if (PyObject_CheckBuffer(out)) {
+        if (PyObject_GetBuffer(out, &view, PyBUF_WRITABLE | PyBUF_C_CONTIGUOUS) < 0)
+            return -1;
+        acquired = true;
+        buffer = view.buf;
+        buffer_size = view.len;
+    }
+    else if (PyObject_AsWriteBuffer(out, &buffer, &buffer_size) < 0) {
+        return -1;
+    }
+    
+    if (buffer_size >= capacity && !overlaps(buffer, buffer_size, input) && !overlaps(buffer, buffer_size, other)) {
+        data = (char*) buffer;
+    }
+    else {
+        temporary.resize(capacity + 1);
+        data = &temporary[0];
+    }
+    return 0;
+}
+
+PyObject*
+Output::finish(Py_ssize_t size)
+{
+    if (result != NULL) {
+        if (size != PyString_GET_SIZE(result) && _PyString_Resize(&result, size) < 0)
+            return NULL;
+        PyObject* output = result;
+        result = NULL;
+        return output;
+    }
+    
+    if (data != buffer) {
+        if (buffer_size < size) {
+            PyErr_Format(ModuleError, "invalid out argument, buffer of %d bytes is smaller than the result of %d bytes",
+                         (int) buffer_size, (int) size);
+            return NULL;
+        }
+        memcpy(buffer, data, size);
+    }
+    return PyInt_FromSsize_t(size);
+}
+
+/* Get the level meter of the optional meter argument of a processing function. */
+static int
+meter_arg(PyObject* meter, LevelMeter** level)
+{
+    *level = NULL;
+    if (meter == NULL || meter == Py_None) {
+        return 0;
+    }
+    if (!PyObject_TypeCheck(meter, &StateType) || ((State*)meter)->type != TYPE_METER) {
+        PyErr_SetString(ModuleError, "invalid meter argument, not a meter state");
+        return -1;
+    }
+    *level = ((State*)meter)->level;
+    return 0;
+}
+
+static PyObject*
+pyaudio_meter(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+    PyObject* input = NULL;
+    int channels = 0; // 1 for a new meter state, if not given
+    int window = 50;
+    double silence = -50.0;
+    PyObject* state = Py_None;
+    
+    static const char *kwlist[] = {
+        "fragment", "channels", "window", "silence", "state",
+    NULL};
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iidO", (char **)kwlist,
+            &input, &channels, &window, &silence, &state)) {
+        return NULL;
+    }
+    
+    Fragment fragment;
+    if (fragment.parse(input, "fragment", true) < 0) {
+        return NULL;
+    }
+    
+    if (state == Py_None) {
+        if (channels == 0) {
+            channels = 1;
+        }
+        if (channels < 1 || window < 1) {
+            PyErr_SetString(ModuleError, "invalid channels or window argument, must be positive");
+            return NULL;
+        }
+        state = State_new(&StateType, NULL, NULL);
+        ((State*)state)->type = TYPE_METER;
+        ((State*)state)->level = new LevelMeter();
+        level_init(((State*)state)->level, channels, window, silence);
+    }
+    else if (!PyObject_TypeCheck(state, &StateType) || ((State*)state)->type != TYPE_METER) {
+        PyErr_SetString(ModuleError, "invalid state argument, not a meter state");
+        return NULL;
+    }
+    else if (channels != 0 && channels != ((State*)state)->level->channels) {
+        PyErr_SetString(ModuleError, "invalid channels argument, does not match the meter state");
+        return NULL;
+    }
+    else {
+        Py_XINCREF(state);
+    }
+    
+    double rms = level_update(((State*)state)->level, fragment.samples(), fragment.count());
+    return Py_BuildValue("(dN)", rms, state);
+}
+
+static PyObject*
+pyaudio_levels(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+    PyObject* state = NULL;
+    
+    static const char *kwlist[] = {
+        "state",
+    NULL};
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O", (char **)kwlist, &state)) {
+        return NULL;
+    }
+    if (!PyObject_TypeCheck(state, &StateType) || ((State*)state)->type != TYPE_METER) {
+        PyErr_SetString(ModuleError, "invalid state argument, not a meter state");
+        return NULL;
+    }
+    return level_object(((State*)state)->level);
+}
+
+
+
 
 static PyObject*
 pyaudio_lin2speex(PyObject* self, PyObject* args, PyObject* kwargs)
@@ -130,13 +625,24 @@ pyaudio_lin2speex(PyObject* self, PyObject* args, PyObject* kwargs)
     PyObject* input = NULL;
     int sample_rate = 0;
     PyObject* state = Py_None;
+    PyObject* out = Py_None;
+    PyObject* meter = Py_None;
     
     static const char *kwlist[] = {
-        "fragment", "sample_rate", "state",
+        "fragment", "sample_rate", "state", "out", "meter",
     NULL};
     
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "S|iO", (char **)kwlist,
-            &input, &sample_rate, &state)) {
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iOOO", (char **)kwlist,
+            &input, &sample_rate, &state, &out, &meter)) {
+        return NULL;
+    }
+    LevelMeter* level = NULL;
+    if (meter_arg(meter, &level) < 0) {
+        return NULL;
+    }
+    
+    Fragment fragment;
+    if (fragment.parse(input, "fragment", true) < 0) {
         return NULL;
     }
  
@@ -148,8 +654,8 @@ pyaudio_lin2speex(PyObject* self, PyObject* args, PyObject* kwargs)
         
         state = State_new(&StateType, NULL, NULL);
         ((State*)state)->type = TYPE_ENCODER;
-        ((State*)state)->value = speex_encoder_init(sample_rate == 8000 ? &speex_nb_mode :
-                            (sample_rate == 16000 ? &speex_wb_mode : &speex_uwb_mode));
+        ((State*)state)->sample_rate = sample_rate;
+        ((State*)state)->value = speex_codec_create(TYPE_ENCODER, sample_rate);
         if (((State*)state)->value == NULL) {
             PyErr_SetString(ModuleError, "failed to create encoder state");
             return NULL;
@@ -163,14 +669,25 @@ pyaudio_lin2speex(PyObject* self, PyObject* args, PyObject* kwargs)
         Py_XINCREF(state);
     }
     
-    short* input_frame = (short*) PyString_AsString(input);
+    short* input_frame = fragment.samples();
+    if (level != NULL) {
+        level_update(level, input_frame, fragment.count());
+    }
     speex_bits_reset(&((State*)state)->bits);
     speex_encode_int(((State*)state)->value, input_frame, &((State*)state)->bits);
 
     int output_size = speex_bits_nbytes(&((State*)state)->bits);
-    char output_bytes[output_size];
-    output_size = speex_bits_write(&((State*)state)->bits, output_bytes, output_size);
-    PyObject* output = PyString_FromStringAndSize(output_bytes, output_size);
+    Output output_bytes;
+    if (output_bytes.open(out, output_size) < 0) {
+        Py_DECREF(state);
+        return NULL;
+    }
+    output_size = speex_bits_write(&((State*)state)->bits, output_bytes.data, output_size);
+    PyObject* output = output_bytes.finish(output_size);
+    if (output == NULL) {
+        Py_DECREF(state);
+        return NULL;
+    }
     return Py_BuildValue("(NN)", output, state);
 }
 
@@ -181,13 +698,24 @@ pyaudio_speex2lin(PyObject* self, PyObject* args, PyObject* kwargs)
     PyObject* input = NULL;
     int sample_rate = 0;
     PyObject* state = Py_None;
+    PyObject* out = Py_None;
+    PyObject* meter = Py_None;
     
     static const char *kwlist[] = {
-        "fragment", "sample_rate", "state",
+        "fragment", "sample_rate", "state", "out", "meter",
     NULL};
     
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "S|iO", (char **)kwlist,
-            &input, &sample_rate, &state)) {
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iOOO", (char **)kwlist,
+            &input, &sample_rate, &state, &out, &meter)) {
+        return NULL;
+    }
+    LevelMeter* level = NULL;
+    if (meter_arg(meter, &level) < 0) {
+        return NULL;
+    }
+    
+    Fragment fragment;
+    if (fragment.parse(input, "fragment", false) < 0) {
         return NULL;
     }
  
@@ -199,8 +727,8 @@ pyaudio_speex2lin(PyObject* self, PyObject* args, PyObject* kwargs)
         
         state = State_new(&StateType, NULL, NULL);
         ((State*)state)->type = TYPE_DECODER;
-        ((State*)state)->value = speex_decoder_init(sample_rate == 8000 ? &speex_nb_mode :
-                            (sample_rate == 16000 ? &speex_wb_mode : &speex_uwb_mode));
+        ((State*)state)->sample_rate = sample_rate;
+        ((State*)state)->value = speex_codec_create(TYPE_DECODER, sample_rate);
         if (((State*)state)->value == NULL) {
             PyErr_SetString(ModuleError, "failed to create decoder state");
             return NULL;
@@ -214,40 +742,204 @@ pyaudio_speex2lin(PyObject* self, PyObject* args, PyObject* kwargs)
         Py_XINCREF(state);
     }
     
-    char* input_bytes = PyString_AsString(input);
-    unsigned int input_size = PyString_Size(input);
+    char* input_bytes = (char*) fragment.data;
+    unsigned int input_size = fragment.size;
     speex_bits_read_from(&((State*)state)->bits, input_bytes, input_size);
     
     int frame_size = 0;
     speex_decoder_ctl(((State*)state)->value, SPEEX_GET_FRAME_SIZE, &frame_size);
     if (frame_size < 0) {
+        Py_DECREF(state);
         PyErr_SetString(ModuleError, "internal error in getting frame size");
         return NULL;
     }
     
-    short output_frame[frame_size];
+    Output output_bytes;
+    if (output_bytes.open(out, frame_size * 2) < 0) {
+        Py_DECREF(state);
+        return NULL;
+    }
+    short* output_frame = (short*) output_bytes.data;
     speex_decode_int(((State*)state)->value, &((State*)state)->bits, output_frame);
-    PyObject* output = PyString_FromStringAndSize((char*) output_frame, frame_size * 2);
+    if (level != NULL) {
+        level_update(level, output_frame, frame_size);
+    }
+    PyObject* output = output_bytes.finish(frame_size * 2);
+    if (output == NULL) {
+        Py_DECREF(state);
+        return NULL;
+    }
     return Py_BuildValue("(NN)", output, state);
 }
 
 
+/* Resampler states with the same rates and quality share one multi-channel speex resampler,
+   which builds its sinc filter table once for all its channels, each channel keeping its
+   own history. Each resampler State owns one channel of a bank until it is deallocated.
+   The first State of given rates and quality gets a plain single channel resampler, and
+   the multi-channel banks are created only when more States with the same rates exist. */
+
+#define RESAMPLER_BANK_CHANNELS 16
+
+struct ResamplerBank {
+    SpeexResamplerState* resampler;
+    int input_rate;
+    int output_rate;
+    int quality;
+    int channels;
+    int used;
+    bool busy[RESAMPLER_BANK_CHANNELS];
+    bool dirty[RESAMPLER_BANK_CHANNELS];
+};
+
+static std::vector<ResamplerBank*> resampler_banks;
+
+/* Clear the history left in a reused channel by a previous State. An idle bank is cleared
+   with speex_resampler_reset_mem, which clears all its channels. A channel of a busy bank
+   is cleared by resampling silence over the filter length, i.e., twice the input latency. */
+static void
+resampler_bank_clear(ResamplerBank* bank, int channel)
+{
+    if (bank->used == 0) {
+        speex_resampler_reset_mem(bank->resampler);
+        memset(bank->dirty, 0, sizeof(bank->dirty));
+        return;
+    }
+    static const short silence[512] = {0};
+    short discard[4096];
+    int remaining = 2 * speex_resampler_get_input_latency(bank->resampler);
+    while (remaining > 0) {
+        spx_uint32_t input_size = remaining < 512 ? remaining : 512;
+        spx_uint32_t output_size = sizeof(discard) / sizeof(discard[0]);
+        speex_resampler_process_int(bank->resampler, channel, silence, &input_size, discard, &output_size);
+        if (input_size == 0)
+            break;
+        remaining -= input_size;
+    }
+    bank->dirty[channel] = false;
+}
+
+static ResamplerBank*
+resampler_bank_acquire(int input_rate, int output_rate, int quality, int* channel)
+{
+    ResamplerBank* bank = NULL;
+    bool shared = false;
+    for (unsigned i=0; i<resampler_banks.size() && bank == NULL; ++i) {
+        ResamplerBank* b = resampler_banks[i];
+        if (b->input_rate == input_rate && b->output_rate == output_rate && b->quality == quality) {
+            shared = true;
+            if (b->used < b->channels)
+                bank = b;
+        }
+    }
+    
+    if (bank == NULL) {
+        int channels = shared ? RESAMPLER_BANK_CHANNELS : 1;
+        int err = 0;
+        SpeexResamplerState* resampler = speex_resampler_init(channels, input_rate, output_rate, quality, &err);
+        if (resampler == NULL) {
+            return NULL;
+        }
+        bank = new ResamplerBank();
+        memset(bank, 0, sizeof(*bank));
+        bank->resampler = resampler;
+        bank->input_rate = input_rate;
+        bank->output_rate = output_rate;
+        bank->quality = quality;
+        bank->channels = channels;
+        resampler_banks.push_back(bank);
+    }
+    
+    // prefer a clean channel, so that a busy bank is cleared only when all its free channels were used
+    int found = -1;
+    for (int i=0; i<bank->channels; ++i) {
+        if (!bank->busy[i] && (found < 0 || (bank->dirty[found] && !bank->dirty[i])))
+            found = i;
+    }
+    if (bank->dirty[found]) {
+        resampler_bank_clear(bank, found);
+    }
+    bank->busy[found] = true;
+    bank->used++;
+    *channel = found;
+    return bank;
+}
+
+/* Destroy the idle banks beyond those needed for max_idle idle channels with the same rates and quality. */
+static void
+resampler_bank_trim()
+{
+    for (unsigned i=0; i<resampler_banks.size(); ) {
+        ResamplerBank* bank = resampler_banks[i];
+        unsigned int idle = 0;
+        for (unsigned j=0; j<i && bank->used == 0; ++j) {
+            ResamplerBank* b = resampler_banks[j];
+            if (b->used == 0 && b->input_rate == bank->input_rate && b->output_rate == bank->output_rate
+                && b->quality == bank->quality) {
+                idle += b->channels;
+            }
+        }
+        if (bank->used == 0 && idle >= pool_max_idle) {
+            resampler_banks.erase(resampler_banks.begin() + i);
+            speex_resampler_destroy(bank->resampler);
+            delete bank;
+        }
+        else {
+            ++i;
+        }
+    }
+}
+
+static void
+resampler_bank_release(ResamplerBank* bank, int channel)
+{
+    bank->busy[channel] = false;
+    bank->dirty[channel] = true;
+    // idle banks are kept for reuse only when pooling is enabled, and only as many as max_idle needs
+    if (--bank->used == 0) {
+        resampler_bank_trim();
+    }
+}
+
+static PyObject*
+pyaudio_resampler_stats(PyObject* self, PyObject* unused)
+{
+    int channels = 0, capacity = 0;
+    for (unsigned i=0; i<resampler_banks.size(); ++i) {
+        channels += resampler_banks[i]->used;
+        capacity += resampler_banks[i]->channels;
+    }
+    return Py_BuildValue("{sisisisi}", "banks", (int) resampler_banks.size(),
+                         "channels", channels, "capacity", capacity, "channels_per_bank", RESAMPLER_BANK_CHANNELS);
+}
+
+
 static PyObject*
 pyaudio_resample(PyObject* self, PyObject* args, PyObject* kwargs)
 {
     PyObject* input = NULL;
     int input_rate = 0;
     int output_rate = 0;
-    int channels = 1;
     int quality = 3;
     PyObject* state = Py_None;
+    PyObject* out = Py_None;
+    PyObject* meter = Py_None;
     
     static const char *kwlist[] = {
-        "fragment", "input_rate", "output_rate", "quality", "state",
+        "fragment", "input_rate", "output_rate", "quality", "state", "out", "meter",
     NULL};
     
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "S|iiiO", (char **)kwlist,
-            &input, &input_rate, &output_rate, &quality, &state)) {
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iiiOOO", (char **)kwlist,
+            &input, &input_rate, &output_rate, &quality, &state, &out, &meter)) {
+        return NULL;
+    }
+    LevelMeter* level = NULL;
+    if (meter_arg(meter, &level) < 0) {
+        return NULL;
+    }
+    
+    Fragment fragment;
+    if (fragment.parse(input, "fragment", true) < 0) {
         return NULL;
     }
     
@@ -257,14 +949,17 @@ pyaudio_resample(PyObject* self, PyObject* args, PyObject* kwargs)
             return NULL;
         }
         
-        state = State_new(&StateType, NULL, NULL);
-        ((State*)state)->type = TYPE_RESAMPLER;
-        int err = 0;
-        ((State*)state)->value = speex_resampler_init(channels, input_rate, output_rate, quality, &err);
-        if (((State*)state)->value == NULL) {
+        int channel = 0;
+        ResamplerBank* bank = resampler_bank_acquire(input_rate, output_rate, quality, &channel);
+        if (bank == NULL) {
             PyErr_SetString(ModuleError, "failed to create resampler state");
             return NULL;
         }
+        state = State_new(&StateType, NULL, NULL);
+        ((State*)state)->type = TYPE_RESAMPLER;
+        ((State*)state)->value = bank->resampler;
+        ((State*)state)->bank = bank;
+        ((State*)state)->channel = channel;
     }
     else if (((State*)state)->type != TYPE_RESAMPLER) {
         PyErr_SetString(ModuleError, "invalid state argument, not a resampler state");
@@ -274,45 +969,278 @@ pyaudio_resample(PyObject* self, PyObject* args, PyObject* kwargs)
         Py_XINCREF(state);
     }
     
-    short* input_bytes = (short*) PyString_AsString(input);
-    unsigned int input_size = PyString_Size(input) / 2;
-    unsigned int output_size = input_size * output_rate / input_rate + 100;
-    short output_bytes[output_size];
+    spx_uint32_t state_input_rate = 0, state_output_rate = 0;
+    speex_resampler_get_rate((SpeexResamplerState*)(((State*)state)->value), &state_input_rate, &state_output_rate);
+    
+    short* input_bytes = fragment.samples();
+    unsigned int input_size = fragment.count();
+    unsigned int output_size = (unsigned int) ((unsigned long long) input_size * state_output_rate / state_input_rate) + 100;
+    Output output_bytes;
+    if (output_bytes.open(out, output_size * 2, &fragment) < 0) {
+        Py_DECREF(state);
+        return NULL;
+    }
     
-    speex_resampler_process_int((SpeexResamplerState*)(((State*)state)->value), 0, input_bytes, &input_size, output_bytes, &output_size);
+    speex_resampler_process_int((SpeexResamplerState*)(((State*)state)->value), ((State*)state)->channel,
+                                input_bytes, &input_size, (short*) output_bytes.data, &output_size);
+    if (level != NULL) {
+        level_update(level, (short*) output_bytes.data, output_size);
+    }
     
-    PyObject* output = PyString_FromStringAndSize((char*) output_bytes, output_size * 2);
+    PyObject* output = output_bytes.finish(output_size * 2);
+    if (output == NULL) {
+        Py_DECREF(state);
+        return NULL;
+    }
     return Py_BuildValue("(NN)", output, state);
 }
 
 
+/* Drift compensation between independent clocks. The samples put at the input clock are
+   queued, and resampled on get at the output clock with a ratio nudged by a proportional
+   and integral control of how far the smoothed queue depth is from its target. The ratio
+   is quantized in steps of 10 ppm, so that the resampler filter is not recomputed on
+   every get. */
+
+#define DRIFT_STEPS 100000
+#define DRIFT_MAX_ADJUST 1000     /* 1% in steps */
+#define DRIFT_GAIN 10.0           /* steps per ms of depth error, i.e., 100 ppm/ms */
+#define DRIFT_INTEGRAL 0.05       /* steps per ms of depth error accumulated on each get */
+#define DRIFT_SMOOTHING 0.05
+
+static unsigned long long
+drift_gcd(unsigned long long a, unsigned long long b)
+{
+    while (b != 0) {
+        unsigned long long t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+static void
+drift_update(State* state)
+{
+    DriftBuffer* drift = state->drift;
+    double depth = (double) (drift->samples.size() - drift->head) * 1000.0 / drift->input_rate;
+    drift->depth_average += (depth - drift->depth_average) * DRIFT_SMOOTHING;
+    
+    double error = drift->depth_average - drift->target;
+    drift->integral += error * DRIFT_INTEGRAL;
+    if (drift->integral > DRIFT_MAX_ADJUST)
+        drift->integral = DRIFT_MAX_ADJUST;
+    else if (drift->integral < -DRIFT_MAX_ADJUST)
+        drift->integral = -DRIFT_MAX_ADJUST;
+    
+    int adjust = (int) (error * DRIFT_GAIN + drift->integral);
+    if (adjust > DRIFT_MAX_ADJUST)
+        adjust = DRIFT_MAX_ADJUST;
+    else if (adjust < -DRIFT_MAX_ADJUST)
+        adjust = -DRIFT_MAX_ADJUST;
+    
+    if (adjust != drift->adjust) {
+        // consume input faster than nominal when the queue is deeper than the target
+        drift->adjust = adjust;
+        // the ratio overflows an int above about 21 kHz, so reduce it in 64-bit to fit spx_uint32_t,
+        // and drop low bits of both if the rates have no large common factor
+        unsigned long long num = (unsigned long long) drift->input_rate * (DRIFT_STEPS + adjust);
+        unsigned long long den = (unsigned long long) drift->output_rate * DRIFT_STEPS;
+        unsigned long long divisor = drift_gcd(num, den);
+        num /= divisor;
+        den /= divisor;
+        while (num > 0xffffffffULL || den > 0xffffffffULL) {
+            num >>= 1;
+            den >>= 1;
+        }
+        speex_resampler_set_rate_frac((SpeexResamplerState*) state->value, (spx_uint32_t) num, (spx_uint32_t) den,
+                                      drift->input_rate, drift->output_rate);
+        state->drift_adjustment = adjust * (1000000.0 / DRIFT_STEPS);
+    }
+}
+
 static PyObject*
-pyaudio_preprocess(PyObject* self, PyObject* args, PyObject* kwargs)
+pyaudio_drift_put(PyObject* self, PyObject* args, PyObject* kwargs)
 {
     PyObject* input = NULL;
-    int frame_size = 0;
-    int sampling_rate = 0;
+    int input_rate = 0;
+    int output_rate = 0;
+    int target = 60;
+    int max_latency = 200;
+    int quality = 3;
     PyObject* state = Py_None;
     
     static const char *kwlist[] = {
-        "fragment", "frame_size", "sampling_rate", "state",
+        "fragment", "input_rate", "output_rate", "target", "max_latency", "quality", "state",
     NULL};
     
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "S|iiO", (char **)kwlist,
-            &input, &frame_size, &sampling_rate, &state)) {
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iiiiiO", (char **)kwlist,
+            &input, &input_rate, &output_rate, &target, &max_latency, &quality, &state)) {
+        return NULL;
+    }
+    
+    Fragment fragment;
+    if (fragment.parse(input, "fragment", true) < 0) {
         return NULL;
     }
     
     if (state == Py_None) {
-        if (frame_size == 0 || sampling_rate == 0) {
-            PyErr_SetString(ModuleError, "invalid or missing frame_size or sampling_rate argument");
+        if (input_rate <= 0 || output_rate <= 0) {
+            PyErr_SetString(ModuleError, "invalid or missing input_rate or output_rate argument");
+            return NULL;
+        }
+        if (target <= 0 || max_latency <= target) {
+            PyErr_SetString(ModuleError, "invalid target or max_latency argument, must be 0 < target < max_latency");
+            return NULL;
+        }
+        
+        state = State_new(&StateType, NULL, NULL);
+        ((State*)state)->type = TYPE_DRIFT;
+        int err = 0;
+        // not shared in a bank, since the rate of this resampler changes
+        ((State*)state)->value = speex_resampler_init(1, input_rate, output_rate, quality, &err);
+        if (((State*)state)->value == NULL) {
+            Py_DECREF(state);
+            PyErr_SetString(ModuleError, "failed to create resampler state");
+            return NULL;
+        }
+        DriftBuffer* drift = new DriftBuffer();
+        drift->head = 0;
+        drift->input_rate = input_rate;
+        drift->output_rate = output_rate;
+        drift->target = target;
+        drift->max_latency = max_latency;
+        drift->depth_average = target;
+        drift->integral = 0;
+        drift->adjust = 0;
+        ((State*)state)->drift = drift;
+    }
+    else if (!PyObject_TypeCheck(state, &StateType) || ((State*)state)->type != TYPE_DRIFT) {
+        PyErr_SetString(ModuleError, "invalid state argument, not a drift state");
+        return NULL;
+    }
+    else {
+        Py_XINCREF(state);
+    }
+    
+    DriftBuffer* drift = ((State*)state)->drift;
+    if (drift->head > 0 && drift->head >= drift->samples.size() / 2) {
+        drift->samples.erase(drift->samples.begin(), drift->samples.begin() + drift->head);
+        drift->head = 0;
+    }
+    drift->samples.insert(drift->samples.end(), fragment.samples(), fragment.samples() + fragment.count());
+    
+    // on overrun, drop the oldest samples down to the target depth
+    size_t depth = drift->samples.size() - drift->head;
+    if (depth > (size_t) drift->max_latency * drift->input_rate / 1000) {
+        drift->head += depth - (size_t) drift->target * drift->input_rate / 1000;
+        drift->depth_average = drift->target;
+        ((State*)state)->drift_overruns++;
+    }
+    
+    int depth_ms = (int) ((drift->samples.size() - drift->head) * 1000 / drift->input_rate);
+    return Py_BuildValue("(iN)", depth_ms, state);
+}
+
+static PyObject*
+pyaudio_drift_get(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+    int samples = 0;
+    PyObject* state = NULL;
+    PyObject* out = Py_None;
+    
+    static const char *kwlist[] = {
+        "samples", "state", "out",
+    NULL};
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "iO|O", (char **)kwlist,
+            &samples, &state, &out)) {
+        return NULL;
+    }
+    if (!PyObject_TypeCheck(state, &StateType) || ((State*)state)->type != TYPE_DRIFT) {
+        PyErr_SetString(ModuleError, "invalid state argument, not a drift state");
+        return NULL;
+    }
+    if (samples < 0) {
+        PyErr_SetString(ModuleError, "invalid samples argument, must not be negative");
+        return NULL;
+    }
+    
+    State* drift_state = (State*) state;
+    DriftBuffer* drift = drift_state->drift;
+    Output output_bytes;
+    if (output_bytes.open(out, samples * 2) < 0) {
+        return NULL;
+    }
+    short* output_frame = (short*) output_bytes.data;
+    spx_uint32_t input_size = drift->samples.size() - drift->head;
+    spx_uint32_t output_size = samples;
+    if (input_size > 0) {
+        speex_resampler_process_int((SpeexResamplerState*) drift_state->value, 0, &drift->samples[drift->head],
+                                    &input_size, output_frame, &output_size);
+        drift->head += input_size;
+    }
+    else {
+        output_size = 0;
+    }
+    if (output_size < (spx_uint32_t) samples) {
+        // underrun, play silence for the rest
+        memset(output_frame + output_size, 0, (samples - output_size) * 2);
+        drift_state->drift_underruns++;
+    }
+    drift_update(drift_state);
+    
+    PyObject* output = output_bytes.finish(samples * 2);
+    if (output == NULL) {
+        return NULL;
+    }
+    Py_INCREF(state);
+    return Py_BuildValue("(NN)", output, state);
+}
+
+
+static PyObject*
+pyaudio_preprocess(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+    PyObject* input = NULL;
+    int frame_size = 0;
+    int sampling_rate = 0;
+    PyObject* state = Py_None;
+    PyObject* out = Py_None;
+    PyObject* meter = Py_None;
+    
+    static const char *kwlist[] = {
+        "fragment", "frame_size", "sampling_rate", "state", "out", "meter",
+    NULL};
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iiOOO", (char **)kwlist,
+            &input, &frame_size, &sampling_rate, &state, &out, &meter)) {
+        return NULL;
+    }
+    LevelMeter* level = NULL;
+    if (meter_arg(meter, &level) < 0) {
+        return NULL;
+    }
+    
+    Fragment fragment;
+    if (fragment.parse(input, "fragment", true) < 0) {
+        return NULL;
+    }
+    
+    if (state == Py_None) {
+        if (frame_size == 0 || sampling_rate == 0) {
+            PyErr_SetString(ModuleError, "invalid or missing frame_size or sampling_rate argument");
             return NULL;
         }
         
         state = State_new(&StateType, NULL, NULL);
         ((State*)state)->type = TYPE_PREPROCESS;
-        ((State*)state)->value = speex_preprocess_state_init(frame_size, sampling_rate);
+        ((State*)state)->value = pool_get(TYPE_PREPROCESS, frame_size, sampling_rate);
+        if (((State*)state)->value == NULL) {
+            ((State*)state)->value = speex_preprocess_state_init(frame_size, sampling_rate);
+        }
         if (((State*)state)->value == NULL) {
+            Py_DECREF(state);
             PyErr_SetString(ModuleError, "failed to create preprocess state");
             return NULL;
         }
@@ -325,14 +1253,26 @@ pyaudio_preprocess(PyObject* self, PyObject* args, PyObject* kwargs)
         Py_XINCREF(state);
     }
     
-    short* input_bytes = (short*) PyString_AsString(input);
-    unsigned int output_size = PyString_Size(input) / 2;
-    short output_bytes[output_size];
-    memcpy(output_bytes, input_bytes, output_size * 2);
+    short* input_bytes = fragment.samples();
+    unsigned int output_size = fragment.count();
+    Output output_bytes;
+    if (output_bytes.open(out, output_size * 2) < 0) {
+        Py_DECREF(state);
+        return NULL;
+    }
+    short* output_frame = (short*) output_bytes.data;
+    memmove(output_frame, input_bytes, output_size * 2); // out may be the input fragment
     
-    speex_preprocess_run((SpeexPreprocessState*)(((State*)state)->value), output_bytes);
+    speex_preprocess_run((SpeexPreprocessState*)(((State*)state)->value), output_frame);
+    if (level != NULL) {
+        level_update(level, output_frame, output_size);
+    }
     
-    PyObject* output = PyString_FromStringAndSize((char*) output_bytes, output_size * 2);
+    PyObject* output = output_bytes.finish(output_size * 2);
+    if (output == NULL) {
+        Py_DECREF(state);
+        return NULL;
+    }
     return Py_BuildValue("(NN)", output, state);
 }
 
@@ -345,13 +1285,19 @@ pyaudio_cancel_echo(PyObject* self, PyObject* args, PyObject* kwargs)
     int frame_size = 0;
     int filter_length = 0;
     PyObject* state = Py_None;
+    PyObject* out = Py_None;
     
     static const char *kwlist[] = {
-        "captured_fragment", "played_fragment", "frame_size", "filter_length", "state",
+        "captured_fragment", "played_fragment", "frame_size", "filter_length", "state", "out",
     NULL};
     
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "SS|iiO", (char **)kwlist,
-            &input, &echo, &frame_size, &filter_length, &state)) {
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|iiOO", (char **)kwlist,
+            &input, &echo, &frame_size, &filter_length, &state, &out)) {
+        return NULL;
+    }
+    
+    Fragment captured, played;
+    if (captured.parse(input, "captured_fragment", true) < 0 || played.parse(echo, "played_fragment", true) < 0) {
         return NULL;
     }
     
@@ -363,13 +1309,19 @@ pyaudio_cancel_echo(PyObject* self, PyObject* args, PyObject* kwargs)
         
         state = State_new(&StateType, NULL, NULL);
         ((State*)state)->type = TYPE_ECHO;
-        ((State*)state)->value  = speex_echo_state_init(frame_size, filter_length);
+        ((State*)state)->frame_size = frame_size;
+        ((State*)state)->filter_length = filter_length;
+        ((State*)state)->value = pool_get(TYPE_ECHO, frame_size, filter_length);
         if (((State*)state)->value == NULL) {
+            ((State*)state)->value = speex_echo_state_init(frame_size, filter_length);
+        }
+        if (((State*)state)->value == NULL) {
+            Py_DECREF(state);
             PyErr_SetString(ModuleError, "failed to create echo cancellation state");
             return NULL;
         }
     }
-    else if (((State*)state)->type != TYPE_PREPROCESS) {
+    else if (((State*)state)->type != TYPE_ECHO) {
         PyErr_SetString(ModuleError, "invalid state argument, not an echo cancellation state");
         return NULL;
     }
@@ -377,47 +1329,2693 @@ pyaudio_cancel_echo(PyObject* self, PyObject* args, PyObject* kwargs)
         Py_XINCREF(state);
     }
     
-    short* input_bytes = (short*) PyString_AsString(input);
-    short* echo_bytes = (short*) PyString_AsString(echo);
-    unsigned int output_size = PyString_Size(input) / 2;
-    short output_bytes[output_size];
+    short* input_bytes = captured.samples();
+    short* echo_bytes = played.samples();
+    unsigned int output_size = captured.count();
+    Output output_bytes;
+    if (output_bytes.open(out, output_size * 2, &captured, &played) < 0) {
+        Py_DECREF(state);
+        return NULL;
+    }
 
-    speex_echo_cancellation((SpeexEchoState*)(((State*)state)->value), input_bytes, echo_bytes, output_bytes);    
+    speex_echo_cancellation((SpeexEchoState*)(((State*)state)->value), input_bytes, echo_bytes, (short*) output_bytes.data);
     
-    PyObject* output = PyString_FromStringAndSize((char*) output_bytes, output_size * 2);
+    PyObject* output = output_bytes.finish(output_size * 2);
+    if (output == NULL) {
+        Py_DECREF(state);
+        return NULL;
+    }
     return Py_BuildValue("(NN)", output, state);
 }
 
-static PyMethodDef Module_methods[] = {
-    {"lin2speex", (PyCFunction) pyaudio_lin2speex, METH_VARARGS | METH_KEYWORDS,
-        PyDoc_STR("Convert samples in the audio fragment to Speex encoding and return this as a Python string.")},
-    {"speex2lin", (PyCFunction) pyaudio_speex2lin, METH_VARARGS | METH_KEYWORDS,
-        PyDoc_STR("Convert the Speex encoded fragment to linear fragment and return this as a Python string.")},
-        
-    {"resample", (PyCFunction) pyaudio_resample, METH_VARARGS | METH_KEYWORDS,
-        PyDoc_STR("Convert the sampling rate of the linear fragment and return this as a Python string.")},
-    {"preprocess", (PyCFunction) pyaudio_preprocess, METH_VARARGS | METH_KEYWORDS,
-        PyDoc_STR("Apply preprocessing steps to the linear fragment and return this as a Python string.")},
-    {"cancel_echo", (PyCFunction) pyaudio_cancel_echo, METH_VARARGS | METH_KEYWORDS,
-        PyDoc_STR("Apply echo cancellation steps to the captured and played linear fragments and return this as a Python string.")},
+/* Random SSRC, initial sequence numbers and timestamps, and stream serials, which must not be
+   predictable (RFC 3550 section 8), are read from /dev/urandom. The private xorshift generator is
+   only a fallback if it cannot be read, and leaves the process-wide rand() seed alone. It is safe
+   to call from the worker threads. */
+static FILE* random_source = NULL;
+static unsigned int random_state = 1;
+
+static unsigned int
+random32()
+{
+    unsigned int value = 0;
+    if (random_source != NULL && fread(&value, sizeof(value), 1, random_source) == 1) {
+        return value;
+    }
+    
+    unsigned int state, next;
+    do {
+        state = random_state;
+        next = state;
+        next ^= next << 13;
+        next ^= next >> 17;
+        next ^= next << 5;
+    } while (!__sync_bool_compare_and_swap(&random_state, state, next));
+    return next;
+}
+
+/* RTP (RFC 3550) fixed header size and the RFC 5574 payload for Speex. */
+#define RTP_HEADER_SIZE 12
+#define RTP_MAX_FRAMES 16
+
+static void
+rtp_write_header(unsigned char* packet, int payload_type, int marker,
+                 unsigned short sequence, unsigned int timestamp, unsigned int ssrc)
+{
+    packet[0] = 0x80;
+    packet[1] = (marker ? 0x80 : 0x00) | (payload_type & 0x7f);
+    packet[2] = (unsigned char) (sequence >> 8);
+    packet[3] = (unsigned char) sequence;
+    packet[4] = (unsigned char) (timestamp >> 24);
+    packet[5] = (unsigned char) (timestamp >> 16);
+    packet[6] = (unsigned char) (timestamp >> 8);
+    packet[7] = (unsigned char) timestamp;
+    packet[8] = (unsigned char) (ssrc >> 24);
+    packet[9] = (unsigned char) (ssrc >> 16);
+    packet[10] = (unsigned char) (ssrc >> 8);
+    packet[11] = (unsigned char) ssrc;
+}
+
+/* Return the RTP header size skipping any CSRC list and header extension, and update
+   packet_size to exclude any padding. Return -1 if not RTP, or -2 if truncated. */
+static int
+rtp_parse_header(const unsigned char* packet, int* packet_size)
+{
+    if (*packet_size < RTP_HEADER_SIZE || (packet[0] >> 6) != 2) {
+        return -1;
+    }
+    int header_size = RTP_HEADER_SIZE + (packet[0] & 0x0f) * 4;
+    if (packet[0] & 0x10) {
+        if (*packet_size < header_size + 4) {
+            return -2;
+        }
+        header_size += 4 + ((packet[header_size + 2] << 8) | packet[header_size + 3]) * 4;
+    }
+    if ((packet[0] & 0x20) && *packet_size > header_size) {
+        *packet_size -= packet[*packet_size - 1];
+    }
+    return *packet_size < header_size ? -2 : header_size;
+}
+
+static inline unsigned short
+rtp_sequence(const unsigned char* packet)
+{
+    return (unsigned short) ((packet[2] << 8) | packet[3]);
+}
+
+/* Track the highest sequence number received from a source. Only a forward gap counts as lost and
+   advances the sequence number. A late or duplicate packet never moves it back, and is counted in
+   late and taken off the lost count, as the cumulative loss of RFC 3550 is the expected less the
+   received packets. Return false for a late or duplicate packet. */
+static bool
+rtp_update_sequence(unsigned short sequence, unsigned short* highest, unsigned int* lost, unsigned int* late)
+{
+    unsigned short gap = (unsigned short) (sequence - *highest - 1);
+    if (gap >= 0x8000) {
+        (*late)++;
+        if (*lost > 0)
+            (*lost)--;
+        return false;
+    }
+    *lost += gap;
+    *highest = sequence;
+    return true;
+}
+
+static inline unsigned int
+rtp_timestamp(const unsigned char* packet)
+{
+    return ((unsigned int) packet[4] << 24) | (packet[5] << 16) | (packet[6] << 8) | packet[7];
+}
+
+static inline unsigned int
+rtp_ssrc(const unsigned char* packet)
+{
+    return ((unsigned int) packet[8] << 24) | (packet[9] << 16) | (packet[10] << 8) | packet[11];
+}
+
+static PyObject*
+pyaudio_lin2rtp(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+    PyObject* input = NULL;
+    int sample_rate = 0;
+    int payload_type = 97;
+    unsigned int ssrc = 0;
+    int marker = 0;
+    PyObject* state = Py_None;
+    PyObject* out = Py_None;
+    
+    static const char *kwlist[] = {
+        "fragment", "sample_rate", "payload_type", "ssrc", "marker", "state", "out",
+    NULL};
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iiIiOO", (char **)kwlist,
+            &input, &sample_rate, &payload_type, &ssrc, &marker, &state, &out)) {
+        return NULL;
+    }
+    
+    Fragment fragment;
+    if (fragment.parse(input, "fragment", true) < 0) {
+        return NULL;
+    }
+    
+    if (state == Py_None) {
+        if (sample_rate != 8000 && sample_rate != 16000 && sample_rate != 32000) {
+            PyErr_SetString(ModuleError, "invalid or missing sample_rate argument, must be 8000, 16000 or 32000");
+            return NULL;
+        }
+        if (payload_type < 0 || payload_type > 127) {
+            PyErr_SetString(ModuleError, "invalid payload_type argument, must be between 0 and 127");
+            return NULL;
+        }
         
-    {NULL, NULL, 0, NULL}  /* Sentinel */
-};
+        state = State_new(&StateType, NULL, NULL);
+        ((State*)state)->type = TYPE_ENCODER;
+        ((State*)state)->sample_rate = sample_rate;
+        ((State*)state)->value = speex_codec_create(TYPE_ENCODER, sample_rate);
+        if (((State*)state)->value == NULL) {
+            Py_DECREF(state);
+            PyErr_SetString(ModuleError, "failed to create encoder state");
+            return NULL;
+        }
+    }
+    else if (!PyObject_TypeCheck(state, &StateType) || ((State*)state)->type != TYPE_ENCODER) {
+        PyErr_SetString(ModuleError, "invalid state argument, not an encoder state");
+        return NULL;
+    }
+    else {
+        if (!((State*)state)->rtp_started && (payload_type < 0 || payload_type > 127)) {
+            PyErr_SetString(ModuleError, "invalid payload_type argument, must be between 0 and 127");
+            return NULL;
+        }
+        Py_XINCREF(state);
+    }
+    
+    State* encoder = (State*) state;
+    if (!encoder->rtp_started) {
+        // also for an encoder state of lin2speex, random initial sequence number and timestamp, as recommended by RFC 3550
+        encoder->payload_type = payload_type;
+        encoder->rtp_ssrc = ssrc != 0 ? ssrc : random32();
+        encoder->rtp_sequence = (unsigned short) random32();
+        encoder->rtp_timestamp = random32();
+        encoder->rtp_started = 1;
+    }
+    short* input_frame = fragment.samples();
+    int input_samples = fragment.count();
+    int frame_size = 0;
+    speex_encoder_ctl(encoder->value, SPEEX_GET_FRAME_SIZE, &frame_size);
+    if (frame_size <= 0 || input_samples < frame_size || input_samples > frame_size * RTP_MAX_FRAMES
+        || input_samples % frame_size != 0) {
+        Py_DECREF(state);
+        PyErr_SetString(ModuleError, "invalid fragment argument, must be one or more complete frames");
+        return NULL;
+    }
+    
+    // multiple frames in a packet are concatenated, and padded to an octet boundary with the terminator
+    int frames = input_samples / frame_size;
+    speex_bits_reset(&encoder->bits);
+    for (int i=0; i<frames; ++i) {
+        speex_encode_int(encoder->value, input_frame + i * frame_size, &encoder->bits);
+    }
+    speex_bits_insert_terminator(&encoder->bits);
+    
+    int payload_size = speex_bits_nbytes(&encoder->bits);
+    Output output_bytes;
+    if (output_bytes.open(out, RTP_HEADER_SIZE + payload_size) < 0) {
+        Py_DECREF(state);
+        return NULL;
+    }
+    unsigned char* packet = (unsigned char*) output_bytes.data;
+    rtp_write_header(packet, encoder->payload_type, marker,
+                     encoder->rtp_sequence, encoder->rtp_timestamp, encoder->rtp_ssrc);
+    payload_size = speex_bits_write(&encoder->bits, (char*) packet + RTP_HEADER_SIZE, payload_size);
+    PyObject* output = output_bytes.finish(RTP_HEADER_SIZE + payload_size);
+    if (output == NULL) {
+        Py_DECREF(state);
+        return NULL;
+    }
+    
+    // the RTP clock rate for Speex is the sampling rate
+    encoder->rtp_sequence++;
+    encoder->rtp_timestamp += frames * frame_size;
+    return Py_BuildValue("(NN)", output, state);
+}
 
 
-PyMODINIT_FUNC
-initaudiospeex(void)
+static PyObject*
+pyaudio_rtp2lin(PyObject* self, PyObject* args, PyObject* kwargs)
 {
-    PyObject *m;
+    PyObject* input = NULL;
+    int sample_rate = 0;
+    PyObject* state = Py_None;
+    PyObject* out = Py_None;
     
-    StateType.tp_new = PyType_GenericNew;
-    if (PyType_Ready(&StateType) < 0)
-        return;
+    static const char *kwlist[] = {
+        "packet", "sample_rate", "state", "out",
+    NULL};
     
-    m = Py_InitModule3("audiospeex", Module_methods, "speex voice codec and quality engine based on the open source speex library");
-    if (m == NULL)
-        return;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iOO", (char **)kwlist,
+            &input, &sample_rate, &state, &out)) {
+        return NULL;
+    }
+    
+    Fragment fragment;
+    if (fragment.parse(input, "packet", false) < 0) {
+        return NULL;
+    }
+    unsigned char* packet = (unsigned char*) fragment.data;
+    int packet_size = fragment.size;
+    
+    int header_size = rtp_parse_header(packet, &packet_size);
+    if (header_size < 0) {
+        PyErr_SetString(ModuleError, header_size == -1 ? "invalid packet argument, not an RTP packet"
+                                                       : "invalid packet argument, truncated RTP packet");
+        return NULL;
+    }
+    
+    if (state == Py_None) {
+        if (sample_rate != 8000 && sample_rate != 16000 && sample_rate != 32000) {
+            PyErr_SetString(ModuleError, "invalid or missing sample_rate argument, must be 8000, 16000 or 32000");
+            return NULL;
+        }
+        
+        state = State_new(&StateType, NULL, NULL);
+        ((State*)state)->type = TYPE_DECODER;
+        ((State*)state)->sample_rate = sample_rate;
+        ((State*)state)->value = speex_codec_create(TYPE_DECODER, sample_rate);
+        if (((State*)state)->value == NULL) {
+            Py_DECREF(state);
+            PyErr_SetString(ModuleError, "failed to create decoder state");
+            return NULL;
+        }
+        ((State*)state)->rtp_ssrc = 0;
+        ((State*)state)->rtp_received = 0;
+    }
+    else if (!PyObject_TypeCheck(state, &StateType) || ((State*)state)->type != TYPE_DECODER) {
+        PyErr_SetString(ModuleError, "invalid state argument, not a decoder state");
+        return NULL;
+    }
+    else {
+        Py_XINCREF(state);
+    }
+    
+    State* decoder = (State*) state;
+    unsigned short sequence = rtp_sequence(packet);
+    unsigned int ssrc = rtp_ssrc(packet);
+    
+    // count the gaps in sequence numbers as lost, restarting on a new source. A late packet is
+    // still decoded, and its timestamp tells where it belongs.
+    if (decoder->rtp_received == 0 || ssrc != decoder->rtp_ssrc) {
+        decoder->rtp_ssrc = ssrc;
+        decoder->rtp_sequence = sequence;
+    }
+    else {
+        rtp_update_sequence(sequence, &decoder->rtp_sequence, &decoder->rtp_lost, &decoder->rtp_late);
+    }
+    decoder->rtp_received++;
+    decoder->rtp_timestamp = rtp_timestamp(packet);
+    decoder->payload_type = packet[1] & 0x7f;
+    decoder->rtp_marker = (packet[1] & 0x80) ? 1 : 0;
+    
+    int frame_size = 0;
+    speex_decoder_ctl(decoder->value, SPEEX_GET_FRAME_SIZE, &frame_size);
+    if (frame_size <= 0) {
+        Py_DECREF(state);
+        PyErr_SetString(ModuleError, "internal error in getting frame size");
+        return NULL;
+    }
+    
+    Output output_bytes;
+    if (output_bytes.open(out, frame_size * RTP_MAX_FRAMES * 2, &fragment) < 0) {
+        Py_DECREF(state);
+        return NULL;
+    }
+    short* output_frame = (short*) output_bytes.data;
+    int frames = 0;
+    speex_bits_read_from(&decoder->bits, (char*) packet + header_size, packet_size - header_size);
+    while (frames < RTP_MAX_FRAMES && speex_bits_remaining(&decoder->bits) >= 5) {
+        if (speex_decode_int(decoder->value, &decoder->bits, output_frame + frames * frame_size) != 0)
+            break;
+        ++frames;
+    }
+    
+    PyObject* output = output_bytes.finish(frames * frame_size * 2);
+    if (output == NULL) {
+        Py_DECREF(state);
+        return NULL;
+    }
+    return Py_BuildValue("(NN)", output, state);
+}
+
+
+#ifdef __linux__
+
+/* Native media relay. Each channel bridges two UDP legs carrying RTP with Speex payload,
+   decoding, resampling and re-encoding between them on relay worker threads that never
+   touch Python. Channels are spread over the workers, each with its own epoll loop,
+   and datagrams are received and sent in batches with recvmmsg and sendmmsg. */
+
+#define RELAY_BATCH 16
+#define RELAY_MAX_DATAGRAM 1500
+#define RELAY_MAX_FRAME 640
+#define RELAY_POLL_MS 100
+
+struct RelayLeg {
+    int fd;
+    int local_port;
+    struct sockaddr_in remote;
+    int has_remote;
+    int sample_rate;
+    int frame_size;
+    int payload_type;
+    void* decoder;
+    void* encoder;
+    SpeexBits decode_bits;
+    SpeexBits encode_bits;
+    // outgoing RTP header of this leg
+    unsigned int ssrc;
+    unsigned int timestamp;
+    unsigned short sequence;
+    // incoming RTP sequence tracking of this leg
+    unsigned int remote_ssrc;
+    unsigned short remote_sequence;
+    // samples received from the other leg, resampled to this leg's rate and not yet encoded
+    short pending[RTP_MAX_FRAMES * RELAY_MAX_FRAME * 4];
+    unsigned int pending_size;
+    unsigned int received, sent, lost, late, errors;
+    // samples decoded on this leg and dropped because the other leg's pending buffer was full
+    unsigned int dropped;
+};
 
+struct RelayChannel {
+    int id;
+    RelayLeg leg[2];
+    SpeexResamplerState* resampler[2]; // resampler[i] converts from leg[i] to the other leg
+};
+
+struct RelayWorker {
+    pthread_t thread;
+    int epoll_fd;
+    pthread_mutex_t lock;
+    std::map<int, RelayChannel*> channels;
+    // batch buffers, used only by the worker thread
+    struct mmsghdr recv_msgs[RELAY_BATCH];
+    struct iovec recv_iov[RELAY_BATCH];
+    struct sockaddr_in recv_addr[RELAY_BATCH];
+    unsigned char recv_buf[RELAY_BATCH][RELAY_MAX_DATAGRAM];
+    struct mmsghdr send_msgs[RELAY_BATCH];
+    struct iovec send_iov[RELAY_BATCH];
+    unsigned char send_buf[RELAY_BATCH][RELAY_MAX_DATAGRAM];
+    int send_count;
+};
+
+static std::vector<RelayWorker*> relay_workers;
+static int relay_running = 0; // read and written with __sync builtins, as the workers poll it
+static int relay_waiting = 0; // Python threads waiting in relay_lock, changed with the GIL held
+static int relay_next_id = 1;
+
+static void
+relay_leg_destroy(RelayLeg* leg)
+{
+    if (leg->fd >= 0)
+        close(leg->fd);
+    if (leg->decoder)
+        speex_decoder_destroy(leg->decoder);
+    if (leg->encoder)
+        speex_encoder_destroy(leg->encoder);
+    speex_bits_destroy(&leg->decode_bits);
+    speex_bits_destroy(&leg->encode_bits);
+}
+
+static void
+relay_channel_destroy(RelayChannel* channel)
+{
+    for (int i=0; i<2; ++i) {
+        relay_leg_destroy(&channel->leg[i]);
+        if (channel->resampler[i])
+            speex_resampler_destroy(channel->resampler[i]);
+    }
+    delete channel;
+}
+
+static void
+relay_flush(RelayWorker* worker, RelayLeg* leg)
+{
+    if (worker->send_count > 0) {
+        int sent = sendmmsg(leg->fd, worker->send_msgs, worker->send_count, MSG_DONTWAIT);
+        if (sent > 0)
+            leg->sent += sent;
+        if (sent < worker->send_count)
+            leg->errors += worker->send_count - (sent > 0 ? sent : 0);
+        worker->send_count = 0;
+    }
+}
+
+/* Encode the complete frames pending on the leg, one frame per packet, into the send batch. */
+static void
+relay_encode(RelayWorker* worker, RelayLeg* leg)
+{
+    unsigned int offset = 0;
+    while (leg->pending_size - offset >= (unsigned int) leg->frame_size) {
+        if (worker->send_count == RELAY_BATCH)
+            relay_flush(worker, leg);
+
+        unsigned char* packet = worker->send_buf[worker->send_count];
+        speex_bits_reset(&leg->encode_bits);
+        speex_encode_int(leg->encoder, leg->pending + offset, &leg->encode_bits);
+        speex_bits_insert_terminator(&leg->encode_bits);
+        int payload_size = speex_bits_write(&leg->encode_bits, (char*) packet + RTP_HEADER_SIZE,
+                                            RELAY_MAX_DATAGRAM - RTP_HEADER_SIZE);
+        rtp_write_header(packet, leg->payload_type, 0, leg->sequence, leg->timestamp, leg->ssrc);
+        leg->sequence++;
+        leg->timestamp += leg->frame_size;
+        offset += leg->frame_size;
+
+        if (leg->has_remote) {
+            struct mmsghdr* msg = &worker->send_msgs[worker->send_count];
+            worker->send_iov[worker->send_count].iov_base = packet;
+            worker->send_iov[worker->send_count].iov_len = RTP_HEADER_SIZE + payload_size;
+            memset(msg, 0, sizeof(*msg));
+            msg->msg_hdr.msg_iov = &worker->send_iov[worker->send_count];
+            msg->msg_hdr.msg_iovlen = 1;
+            msg->msg_hdr.msg_name = &leg->remote;
+            msg->msg_hdr.msg_namelen = sizeof(leg->remote);
+            worker->send_count++;
+        }
+    }
+    if (offset > 0) {
+        leg->pending_size -= offset;
+        memmove(leg->pending, leg->pending + offset, leg->pending_size * 2);
+    }
+}
+
+/* Decode a datagram received on leg[index], and resample it to the pending samples of the other leg. */
+static void
+relay_decode(RelayChannel* channel, int index, unsigned char* packet, int packet_size, const struct sockaddr_in* from)
+{
+    RelayLeg* leg = &channel->leg[index];
+    RelayLeg* other = &channel->leg[1 - index];
+
+    int header_size = rtp_parse_header(packet, &packet_size);
+    if (header_size < 0 || (packet[1] & 0x7f) != leg->payload_type) {
+        leg->errors++;
+        return;
+    }
+    if (!leg->has_remote) {
+        // symmetric RTP, send to where the first packet came from
+        leg->remote = *from;
+        leg->has_remote = 1;
+    }
+    else if (from->sin_addr.s_addr != leg->remote.sin_addr.s_addr || from->sin_port != leg->remote.sin_port) {
+        // only the remote address is trusted, once given or latched
+        leg->errors++;
+        return;
+    }
+
+    // a late or duplicate packet is dropped, as the samples after it are already relayed
+    unsigned short sequence = rtp_sequence(packet);
+    unsigned int ssrc = rtp_ssrc(packet);
+    leg->received++;
+    if (leg->received == 1 || ssrc != leg->remote_ssrc) {
+        leg->remote_ssrc = ssrc;
+        leg->remote_sequence = sequence;
+    }
+    else if (!rtp_update_sequence(sequence, &leg->remote_sequence, &leg->lost, &leg->late)) {
+        return;
+    }
+
+    short decoded[RTP_MAX_FRAMES * RELAY_MAX_FRAME];
+    unsigned int decoded_size = 0;
+    speex_bits_read_from(&leg->decode_bits, (char*) packet + header_size, packet_size - header_size);
+    while (decoded_size + leg->frame_size <= sizeof(decoded) / sizeof(decoded[0])
+           && speex_bits_remaining(&leg->decode_bits) >= 5) {
+        if (speex_decode_int(leg->decoder, &leg->decode_bits, decoded + decoded_size) != 0)
+            break;
+        decoded_size += leg->frame_size;
+    }
+
+    unsigned int space = sizeof(other->pending) / sizeof(other->pending[0]) - other->pending_size;
+    if (channel->resampler[index] != NULL) {
+        spx_uint32_t input_size = decoded_size, output_size = space;
+        speex_resampler_process_int(channel->resampler[index], 0, decoded, &input_size,
+                                    other->pending + other->pending_size, &output_size);
+        other->pending_size += output_size;
+        leg->dropped += decoded_size - input_size;
+    }
+    else {
+        if (decoded_size > space) {
+            leg->dropped += decoded_size - space;
+            decoded_size = space;
+        }
+        memcpy(other->pending + other->pending_size, decoded, decoded_size * 2);
+        other->pending_size += decoded_size;
+    }
+}
+
+static void
+relay_receive(RelayWorker* worker, RelayChannel* channel, int index)
+{
+    RelayLeg* leg = &channel->leg[index];
+    for (int i=0; i<RELAY_BATCH; ++i) {
+        worker->recv_iov[i].iov_base = worker->recv_buf[i];
+        worker->recv_iov[i].iov_len = RELAY_MAX_DATAGRAM;
+        memset(&worker->recv_msgs[i], 0, sizeof(worker->recv_msgs[i]));
+        worker->recv_msgs[i].msg_hdr.msg_iov = &worker->recv_iov[i];
+        worker->recv_msgs[i].msg_hdr.msg_iovlen = 1;
+        worker->recv_msgs[i].msg_hdr.msg_name = &worker->recv_addr[i];
+        worker->recv_msgs[i].msg_hdr.msg_namelen = sizeof(worker->recv_addr[i]);
+    }
+
+    int count = recvmmsg(leg->fd, worker->recv_msgs, RELAY_BATCH, MSG_DONTWAIT, NULL);
+    for (int i=0; i<count; ++i) {
+        relay_decode(channel, index, worker->recv_buf[i], worker->recv_msgs[i].msg_len, &worker->recv_addr[i]);
+        relay_encode(worker, &channel->leg[1 - index]);
+    }
+    relay_flush(worker, &channel->leg[1 - index]);
+}
+
+static void*
+relay_run(void* arg)
+{
+    RelayWorker* worker = (RelayWorker*) arg;
+    struct epoll_event events[RELAY_BATCH];
+
+    while (__sync_fetch_and_add(&relay_running, 0)) {
+        int count = epoll_wait(worker->epoll_fd, events, RELAY_BATCH, RELAY_POLL_MS);
+        if (count <= 0)
+            continue;
+
+        // look up the channel by id under the lock, since it may be removed after epoll_wait returns,
+        // and keep the lock only while receiving on that channel
+        for (int i=0; i<count; ++i) {
+            int id = (int) (events[i].data.u64 >> 1);
+            pthread_mutex_lock(&worker->lock);
+            std::map<int, RelayChannel*>::iterator it = worker->channels.find(id);
+            if (it != worker->channels.end()) {
+                relay_receive(worker, it->second, (int) (events[i].data.u64 & 1));
+            }
+            pthread_mutex_unlock(&worker->lock);
+        }
+    }
+    return NULL;
+}
+
+/* Lock the worker from a Python thread, without holding the GIL while the worker receives. */
+static void
+relay_lock(RelayWorker* worker)
+{
+    if (pthread_mutex_trylock(&worker->lock) != 0) {
+        relay_waiting++;
+        Py_BEGIN_ALLOW_THREADS
+        pthread_mutex_lock(&worker->lock);
+        Py_END_ALLOW_THREADS
+        relay_waiting--;
+    }
+}
+
+static RelayWorker*
+relay_find(int id, std::map<int, RelayChannel*>::iterator* found)
+{
+    for (unsigned i=0; i<relay_workers.size(); ++i) {
+        RelayWorker* worker = relay_workers[i];
+        relay_lock(worker);
+        std::map<int, RelayChannel*>::iterator it = worker->channels.find(id);
+        if (it != worker->channels.end()) {
+            *found = it;
+            return worker; // with the lock held
+        }
+        pthread_mutex_unlock(&worker->lock);
+    }
+    return NULL;
+}
+
+static int
+relay_address(PyObject* address, struct sockaddr_in* addr, const char* name)
+{
+    const char* host = NULL;
+    int port = 0;
+    if (!PyTuple_Check(address) || !PyArg_ParseTuple(address, "si", &host, &port)) {
+        PyErr_Clear();
+        PyErr_Format(ModuleError, "invalid %s argument, must be a (host, port) tuple", name);
+        return -1;
+    }
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+    if (host[0] == '\0') {
+        addr->sin_addr.s_addr = htonl(INADDR_ANY);
+    }
+    else if (inet_pton(AF_INET, host, &addr->sin_addr) != 1) {
+        struct addrinfo hints, *result = NULL;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_DGRAM;
+        if (getaddrinfo(host, NULL, &hints, &result) != 0 || result == NULL) {
+            PyErr_Format(ModuleError, "invalid %s argument, cannot resolve host %s", name, host);
+            return -1;
+        }
+        addr->sin_addr = ((struct sockaddr_in*) result->ai_addr)->sin_addr;
+        freeaddrinfo(result);
+    }
+    return 0;
+}
+
+static int
+relay_leg_init(RelayLeg* leg, PyObject* local, PyObject* remote, int sample_rate, int payload_type, const char* name)
+{
+    char arg[32];
+    struct sockaddr_in addr;
+
+    if (sample_rate != 8000 && sample_rate != 16000 && sample_rate != 32000) {
+        PyErr_Format(ModuleError, "invalid sample_rate_%s argument, must be 8000, 16000 or 32000", name);
+        return -1;
+    }
+    const SpeexMode* mode = speex_mode(sample_rate);
+    leg->sample_rate = sample_rate;
+    leg->payload_type = payload_type & 0x7f;
+    leg->decoder = speex_decoder_init(mode);
+    leg->encoder = speex_encoder_init(mode);
+    if (leg->decoder == NULL || leg->encoder == NULL) {
+        PyErr_SetString(ModuleError, "failed to create codec state");
+        return -1;
+    }
+    speex_encoder_ctl(leg->encoder, SPEEX_GET_FRAME_SIZE, &leg->frame_size);
+    leg->ssrc = random32();
+    leg->sequence = (unsigned short) random32();
+    leg->timestamp = random32();
+
+    if (remote != Py_None) {
+        snprintf(arg, sizeof(arg), "remote_%s", name);
+        if (relay_address(remote, &leg->remote, arg) < 0)
+            return -1;
+        leg->has_remote = 1;
+    }
+
+    snprintf(arg, sizeof(arg), "local_%s", name);
+    if (relay_address(local, &addr, arg) < 0)
+        return -1;
+    leg->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (leg->fd < 0 || bind(leg->fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        PyErr_SetFromErrno(ModuleError);
+        return -1;
+    }
+    socklen_t addr_size = sizeof(addr);
+    getsockname(leg->fd, (struct sockaddr*) &addr, &addr_size);
+    leg->local_port = ntohs(addr.sin_port);
+    return 0;
+}
+
+static PyObject*
+pyaudio_relay_stop(PyObject* self, PyObject* unused)
+{
+    __sync_bool_compare_and_swap(&relay_running, 1, 0);
+
+    Py_BEGIN_ALLOW_THREADS
+    for (unsigned i=0; i<relay_workers.size(); ++i) {
+        pthread_join(relay_workers[i]->thread, NULL);
+    }
+    Py_END_ALLOW_THREADS
+    // let the threads waiting for a worker lock finish before the workers are freed
+    while (relay_waiting > 0) {
+        Py_BEGIN_ALLOW_THREADS
+        usleep(1000);
+        Py_END_ALLOW_THREADS
+    }
+
+    for (unsigned i=0; i<relay_workers.size(); ++i) {
+        RelayWorker* worker = relay_workers[i];
+        for (std::map<int, RelayChannel*>::iterator it = worker->channels.begin(); it != worker->channels.end(); ++it) {
+            relay_channel_destroy(it->second);
+        }
+        close(worker->epoll_fd);
+        pthread_mutex_destroy(&worker->lock);
+        delete worker;
+    }
+    relay_workers.clear();
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject*
+pyaudio_relay_start(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+    int threads = 1;
+
+    static const char *kwlist[] = {
+        "threads",
+    NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|i", (char **)kwlist, &threads)) {
+        return NULL;
+    }
+    if (threads < 1) {
+        PyErr_SetString(ModuleError, "invalid threads argument, must be at least 1");
+        return NULL;
+    }
+    if (!__sync_bool_compare_and_swap(&relay_running, 0, 1)) {
+        PyErr_SetString(ModuleError, "relay is already started");
+        return NULL;
+    }
+
+    for (int i=0; i<threads; ++i) {
+        RelayWorker* worker = new RelayWorker();
+        worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        worker->send_count = 0;
+        pthread_mutex_init(&worker->lock, NULL);
+        relay_workers.push_back(worker);
+        int err = worker->epoll_fd < 0 ? errno : pthread_create(&worker->thread, NULL, relay_run, worker);
+        if (err != 0) {
+            // pthread_create returns the error instead of setting errno
+            errno = err;
+            PyErr_SetFromErrno(ModuleError);
+            relay_workers.pop_back();
+            if (worker->epoll_fd >= 0)
+                close(worker->epoll_fd);
+            pthread_mutex_destroy(&worker->lock);
+            delete worker;
+            break;
+        }
+    }
+    if (PyErr_Occurred()) {
+        PyObject *type, *value, *traceback;
+        PyErr_Fetch(&type, &value, &traceback);
+        Py_XDECREF(pyaudio_relay_stop(self, NULL));
+        PyErr_Restore(type, value, traceback);
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject*
+pyaudio_relay_add(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+    PyObject* local_a = NULL, *remote_a = Py_None, *local_b = NULL, *remote_b = Py_None;
+    int sample_rate_a = 0, sample_rate_b = 0;
+    int payload_type_a = 97, payload_type_b = 97;
+    int quality = 3;
+
+    static const char *kwlist[] = {
+        "local_a", "remote_a", "sample_rate_a", "local_b", "remote_b", "sample_rate_b",
+        "payload_type_a", "payload_type_b", "quality",
+    NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOiOOi|iii", (char **)kwlist,
+            &local_a, &remote_a, &sample_rate_a, &local_b, &remote_b, &sample_rate_b,
+            &payload_type_a, &payload_type_b, &quality)) {
+        return NULL;
+    }
+    if (!__sync_fetch_and_add(&relay_running, 0)) {
+        PyErr_SetString(ModuleError, "relay is not started");
+        return NULL;
+    }
+
+    RelayChannel* channel = new RelayChannel();
+    memset(channel, 0, sizeof(*channel));
+    for (int i=0; i<2; ++i) {
+        channel->leg[i].fd = -1;
+        speex_bits_init(&channel->leg[i].decode_bits);
+        speex_bits_init(&channel->leg[i].encode_bits);
+    }
+    if (relay_leg_init(&channel->leg[0], local_a, remote_a, sample_rate_a, payload_type_a, "a") < 0
+        || relay_leg_init(&channel->leg[1], local_b, remote_b, sample_rate_b, payload_type_b, "b") < 0) {
+        relay_channel_destroy(channel);
+        return NULL;
+    }
+    if (sample_rate_a != sample_rate_b) {
+        int err = 0;
+        channel->resampler[0] = speex_resampler_init(1, sample_rate_a, sample_rate_b, quality, &err);
+        channel->resampler[1] = speex_resampler_init(1, sample_rate_b, sample_rate_a, quality, &err);
+        if (channel->resampler[0] == NULL || channel->resampler[1] == NULL) {
+            relay_channel_destroy(channel);
+            PyErr_SetString(ModuleError, "failed to create resampler state");
+            return NULL;
+        }
+    }
+
+    channel->id = relay_next_id++;
+    RelayWorker* worker = relay_workers[channel->id % relay_workers.size()];
+    int err = 0;
+    relay_lock(worker);
+    worker->channels[channel->id] = channel;
+    for (int i=0; i<2; ++i) {
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.u64 = ((uint64_t) channel->id << 1) | i;
+        if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, channel->leg[i].fd, &event) < 0) {
+            err = errno;
+            if (i > 0)
+                epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, channel->leg[0].fd, NULL);
+            worker->channels.erase(channel->id);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&worker->lock);
+    if (err != 0) {
+        relay_channel_destroy(channel);
+        errno = err;
+        PyErr_SetFromErrno(ModuleError);
+        return NULL;
+    }
+
+    return Py_BuildValue("(iii)", channel->id, channel->leg[0].local_port, channel->leg[1].local_port);
+}
+
+static PyObject*
+pyaudio_relay_remove(PyObject* self, PyObject* args)
+{
+    int id = 0;
+    if (!PyArg_ParseTuple(args, "i", &id)) {
+        return NULL;
+    }
+
+    std::map<int, RelayChannel*>::iterator it;
+    RelayWorker* worker = relay_find(id, &it);
+    if (worker == NULL) {
+        PyErr_SetString(ModuleError, "invalid id argument, relay channel not found");
+        return NULL;
+    }
+    RelayChannel* channel = it->second;
+    worker->channels.erase(it);
+    int err = 0;
+    for (int i=0; i<2; ++i) {
+        if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, channel->leg[i].fd, NULL) < 0)
+            err = errno;
+    }
+    pthread_mutex_unlock(&worker->lock);
+    // closing the sockets removes them from the epoll set anyway, so the channel is gone either way
+    relay_channel_destroy(channel);
+    if (err != 0) {
+        errno = err;
+        PyErr_SetFromErrno(ModuleError);
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject*
+pyaudio_relay_stats(PyObject* self, PyObject* args)
+{
+    int id = 0;
+    if (!PyArg_ParseTuple(args, "i", &id)) {
+        return NULL;
+    }
+
+    std::map<int, RelayChannel*>::iterator it;
+    RelayWorker* worker = relay_find(id, &it);
+    if (worker == NULL) {
+        PyErr_SetString(ModuleError, "invalid id argument, relay channel not found");
+        return NULL;
+    }
+    const RelayLeg* a = &it->second->leg[0], *b = &it->second->leg[1];
+    int port_a = a->local_port, port_b = b->local_port;
+    unsigned int received_a = a->received, sent_a = a->sent, lost_a = a->lost, late_a = a->late, errors_a = a->errors, dropped_a = a->dropped;
+    unsigned int received_b = b->received, sent_b = b->sent, lost_b = b->lost, late_b = b->late, errors_b = b->errors, dropped_b = b->dropped;
+    pthread_mutex_unlock(&worker->lock);
+
+    return Py_BuildValue("{s{sisIsIsIsIsIsI}s{sisIsIsIsIsIsI}}",
+        "a", "local_port", port_a, "received", received_a, "sent", sent_a, "lost", lost_a, "late", late_a, "errors", errors_a, "dropped", dropped_a,
+        "b", "local_port", port_b, "received", received_b, "sent", sent_b, "lost", lost_b, "late", late_b, "errors", errors_b, "dropped", dropped_b);
+}
+
+#endif /* __linux__ */
+
+
+#ifdef HAVE_OPUS
+
+/* The recommended maximum packet size, and the maximum frame duration of 120 ms. */
+#define OPUS_MAX_PACKET 4000
+#define OPUS_MAX_FRAME_MS 120
+
+static bool
+is_opus_sample_rate(int sample_rate)
+{
+    return sample_rate == 8000 || sample_rate == 12000 || sample_rate == 16000
+        || sample_rate == 24000 || sample_rate == 48000;
+}
+
+/* Return the Opus application mode for the name, or -1 if invalid, with the error set. */
+static int
+opus_application(const char* application)
+{
+    if (strcmp(application, "voip") == 0)
+        return OPUS_APPLICATION_VOIP;
+    if (strcmp(application, "audio") == 0)
+        return OPUS_APPLICATION_AUDIO;
+    if (strcmp(application, "lowdelay") == 0)
+        return OPUS_APPLICATION_RESTRICTED_LOWDELAY;
+    PyErr_SetString(ModuleError, "invalid application argument, must be \"voip\", \"audio\" or \"lowdelay\"");
+    return -1;
+}
+
+static PyObject*
+pyaudio_lin2opus(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+    PyObject* input = NULL;
+    int sample_rate = 0;
+    int channels = 1;
+    int bitrate = 0;
+    int fec = 0;
+    int packet_loss = 0;
+    const char* application = "voip";
+    PyObject* state = Py_None;
+    PyObject* out = Py_None;
+    
+    static const char *kwlist[] = {
+        "fragment", "sample_rate", "channels", "bitrate", "fec", "packet_loss", "application", "state", "out",
+    NULL};
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iiiiisOO", (char **)kwlist,
+            &input, &sample_rate, &channels, &bitrate, &fec, &packet_loss, &application, &state, &out)) {
+        return NULL;
+    }
+    
+    Fragment fragment;
+    if (fragment.parse(input, "fragment", true) < 0) {
+        return NULL;
+    }
+    
+    if (state == Py_None) {
+        if (!is_opus_sample_rate(sample_rate)) {
+            PyErr_SetString(ModuleError, "invalid or missing sample_rate argument, must be 8000, 12000, 16000, 24000 or 48000");
+            return NULL;
+        }
+        if (channels != 1 && channels != 2) {
+            PyErr_SetString(ModuleError, "invalid channels argument, must be 1 or 2");
+            return NULL;
+        }
+        int mode = opus_application(application);
+        if (mode < 0) {
+            return NULL;
+        }
+        
+        state = State_new(&StateType, NULL, NULL);
+        ((State*)state)->type = TYPE_OPUS_ENCODER;
+        ((State*)state)->sample_rate = sample_rate;
+        ((State*)state)->channels = channels;
+        ((State*)state)->application = mode;
+        int err = OPUS_OK;
+        OpusEncoder* encoder = (OpusEncoder*) pool_get(TYPE_OPUS_ENCODER, sample_rate, channels + 4 * mode);
+        if (encoder == NULL) {
+            encoder = opus_encoder_create(sample_rate, channels, mode, &err);
+        }
+        ((State*)state)->value = encoder;
+        if (encoder == NULL || err != OPUS_OK) {
+            Py_DECREF(state);
+            PyErr_SetString(ModuleError, "failed to create opus encoder state");
+            return NULL;
+        }
+        // a pooled encoder keeps its previous settings, hence set all of them
+        opus_encoder_ctl(encoder, OPUS_SET_BITRATE(bitrate > 0 ? bitrate : OPUS_AUTO));
+        opus_encoder_ctl(encoder, OPUS_SET_INBAND_FEC(fec ? 1 : 0));
+        opus_encoder_ctl(encoder, OPUS_SET_PACKET_LOSS_PERC(fec ? (packet_loss > 0 ? packet_loss : 10) : 0));
+    }
+    else if (!PyObject_TypeCheck(state, &StateType) || ((State*)state)->type != TYPE_OPUS_ENCODER) {
+        PyErr_SetString(ModuleError, "invalid state argument, not an opus encoder state");
+        return NULL;
+    }
+    else {
+        Py_XINCREF(state);
+    }
+    
+    int frame_size = fragment.count() / ((State*)state)->channels;
+    Output output_bytes;
+    if (output_bytes.open(out, OPUS_MAX_PACKET, &fragment) < 0) {
+        Py_DECREF(state);
+        return NULL;
+    }
+    int output_size = opus_encode((OpusEncoder*)((State*)state)->value, (const opus_int16*) fragment.samples(),
+                                  frame_size, (unsigned char*) output_bytes.data, OPUS_MAX_PACKET);
+    if (output_size < 0) {
+        Py_DECREF(state);
+        PyErr_Format(ModuleError, "failed to encode opus frame: %s", opus_strerror(output_size));
+        return NULL;
+    }
+    
+    PyObject* output = output_bytes.finish(output_size);
+    if (output == NULL) {
+        Py_DECREF(state);
+        return NULL;
+    }
+    return Py_BuildValue("(NN)", output, state);
+}
+
+
+static PyObject*
+pyaudio_opus2lin(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+    PyObject* input = NULL;
+    int sample_rate = 0;
+    int channels = 1;
+    int fec = 0;
+    int frame_size = 0;
+    PyObject* state = Py_None;
+    PyObject* out = Py_None;
+    
+    static const char *kwlist[] = {
+        "fragment", "sample_rate", "channels", "fec", "frame_size", "state", "out",
+    NULL};
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iiiiOO", (char **)kwlist,
+            &input, &sample_rate, &channels, &fec, &frame_size, &state, &out)) {
+        return NULL;
+    }
+    
+    Fragment fragment;
+    if (fragment.parse(input, "fragment", false) < 0) {
+        return NULL;
+    }
+    
+    if (state == Py_None) {
+        if (!is_opus_sample_rate(sample_rate)) {
+            PyErr_SetString(ModuleError, "invalid or missing sample_rate argument, must be 8000, 12000, 16000, 24000 or 48000");
+            return NULL;
+        }
+        if (channels != 1 && channels != 2) {
+            PyErr_SetString(ModuleError, "invalid channels argument, must be 1 or 2");
+            return NULL;
+        }
+        
+        state = State_new(&StateType, NULL, NULL);
+        ((State*)state)->type = TYPE_OPUS_DECODER;
+        ((State*)state)->sample_rate = sample_rate;
+        ((State*)state)->channels = channels;
+        ((State*)state)->frame_size = sample_rate / 50;
+        int err = OPUS_OK;
+        ((State*)state)->value = pool_get(TYPE_OPUS_DECODER, sample_rate, channels);
+        if (((State*)state)->value == NULL) {
+            ((State*)state)->value = opus_decoder_create(sample_rate, channels, &err);
+        }
+        if (((State*)state)->value == NULL || err != OPUS_OK) {
+            Py_DECREF(state);
+            PyErr_SetString(ModuleError, "failed to create opus decoder state");
+            return NULL;
+        }
+    }
+    else if (!PyObject_TypeCheck(state, &StateType) || ((State*)state)->type != TYPE_OPUS_DECODER) {
+        PyErr_SetString(ModuleError, "invalid state argument, not an opus decoder state");
+        return NULL;
+    }
+    else {
+        Py_XINCREF(state);
+    }
+    
+    State* decoder = (State*) state;
+    unsigned char* input_bytes = (unsigned char*) fragment.data;
+    int input_size = fragment.size;
+    
+    // an empty fragment is a lost packet, which is concealed for the given or last frame duration.
+    // With fec, the fragment is the packet after the lost one, from which the lost frame is recovered.
+    int max_frame_size = decoder->sample_rate * OPUS_MAX_FRAME_MS / 1000;
+    int decode_size = max_frame_size;
+    if (input_size == 0 || fec) {
+        decode_size = frame_size > 0 ? frame_size : decoder->frame_size;
+        if (decode_size > max_frame_size)
+            decode_size = max_frame_size;
+    }
+    
+    Output output_bytes;
+    if (output_bytes.open(out, max_frame_size * decoder->channels * 2, &fragment) < 0) {
+        Py_DECREF(state);
+        return NULL;
+    }
+    int output_size = opus_decode((OpusDecoder*) decoder->value, input_size > 0 ? input_bytes : NULL, input_size,
+                                  (opus_int16*) output_bytes.data, decode_size, input_size > 0 && fec ? 1 : 0);
+    if (output_size < 0) {
+        Py_DECREF(state);
+        PyErr_Format(ModuleError, "failed to decode opus frame: %s", opus_strerror(output_size));
+        return NULL;
+    }
+    if (input_size > 0 && !fec) {
+        decoder->frame_size = output_size;
+    }
+    
+    PyObject* output = output_bytes.finish(output_size * decoder->channels * 2);
+    if (output == NULL) {
+        Py_DECREF(state);
+        return NULL;
+    }
+    return Py_BuildValue("(NN)", output, state);
+}
+
+#endif /* HAVE_OPUS */
+
+
+static void
+pool_trim()
+{
+    for (std::map<unsigned long long, std::vector<void*> >::iterator it = state_pool.begin(); it != state_pool.end(); ++it) {
+        while (it->second.size() > pool_max_idle) {
+            pool_destroy((int) (it->first >> 56), it->second.back());
+            it->second.pop_back();
+        }
+    }
+    resampler_bank_trim();
+}
+
+static PyObject*
+pyaudio_pool_config(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+    int max_idle = 0;
+    
+    static const char *kwlist[] = {
+        "max_idle",
+    NULL};
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "i", (char **)kwlist, &max_idle)) {
+        return NULL;
+    }
+    if (max_idle < 0) {
+        PyErr_SetString(ModuleError, "invalid max_idle argument, must not be negative");
+        return NULL;
+    }
+    pool_max_idle = max_idle;
+    pool_trim();
+    
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject*
+pyaudio_pool_warm(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+    const char* kind = NULL;
+    int count = 0;
+    int sample_rate = 0, channels = 1, frame_size = 0, filter_length = 0;
+    int input_rate = 0, output_rate = 0, quality = 3;
+    const char* application = "voip";
+    
+    static const char *kwlist[] = {
+        "kind", "count", "sample_rate", "channels", "frame_size", "filter_length",
+        "input_rate", "output_rate", "quality", "application",
+    NULL};
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "si|iiiiiiis", (char **)kwlist,
+            &kind, &count, &sample_rate, &channels, &frame_size, &filter_length,
+            &input_rate, &output_rate, &quality, &application)) {
+        return NULL;
+    }
+    if (count <= 0) {
+        return Py_BuildValue("i", 0);
+    }
+    if (pool_max_idle == 0) {
+        PyErr_SetString(ModuleError, "pooling is disabled, set max_idle with pool_config first");
+        return NULL;
+    }
+    if ((unsigned int) count > pool_max_idle) {
+        count = pool_max_idle;
+    }
+    
+    int added = 0;
+    if (strcmp(kind, "resampler") == 0) {
+        if (input_rate <= 0 || output_rate <= 0) {
+            PyErr_SetString(ModuleError, "invalid or missing input_rate or output_rate argument");
+            return NULL;
+        }
+        // acquire and release channels, which keeps the idle banks since pooling is enabled
+        std::vector<std::pair<ResamplerBank*, int> > acquired;
+        for (int i=0; i<count; ++i) {
+            int channel = 0;
+            ResamplerBank* bank = resampler_bank_acquire(input_rate, output_rate, quality, &channel);
+            if (bank == NULL)
+                break;
+            acquired.push_back(std::make_pair(bank, channel));
+        }
+        for (unsigned i=0; i<acquired.size(); ++i) {
+            resampler_bank_release(acquired[i].first, acquired[i].second);
+            acquired[i].first->dirty[acquired[i].second] = false;
+        }
+        return Py_BuildValue("i", (int) acquired.size());
+    }
+    
+    int type = 0, a = 0, b = 0;
+    if (strcmp(kind, "encoder") == 0 || strcmp(kind, "decoder") == 0) {
+        if (sample_rate != 8000 && sample_rate != 16000 && sample_rate != 32000) {
+            PyErr_SetString(ModuleError, "invalid or missing sample_rate argument, must be 8000, 16000 or 32000");
+            return NULL;
+        }
+        type = kind[0] == 'e' ? TYPE_ENCODER : TYPE_DECODER;
+        a = sample_rate;
+    }
+    else if (strcmp(kind, "echo") == 0) {
+        if (frame_size <= 0 || filter_length <= 0) {
+            PyErr_SetString(ModuleError, "invalid or missing frame_size or filter_length argument");
+            return NULL;
+        }
+        type = TYPE_ECHO;
+        a = frame_size;
+        b = filter_length;
+    }
+    else if (strcmp(kind, "preprocess") == 0) {
+        if (frame_size <= 0 || sample_rate <= 0) {
+            PyErr_SetString(ModuleError, "invalid or missing frame_size or sample_rate argument");
+            return NULL;
+        }
+        type = TYPE_PREPROCESS;
+        a = frame_size;
+        b = sample_rate;
+    }
+#ifdef HAVE_OPUS
+    else if (strcmp(kind, "opus_encoder") == 0 || strcmp(kind, "opus_decoder") == 0) {
+        if (!is_opus_sample_rate(sample_rate) || (channels != 1 && channels != 2)) {
+            PyErr_SetString(ModuleError, "invalid or missing sample_rate or channels argument");
+            return NULL;
+        }
+        int mode = opus_application(application);
+        if (mode < 0) {
+            return NULL;
+        }
+        type = kind[5] == 'e' ? TYPE_OPUS_ENCODER : TYPE_OPUS_DECODER;
+        a = sample_rate;
+        b = type == TYPE_OPUS_ENCODER ? channels + 4 * mode : channels;
+    }
+#endif
+    else {
+        PyErr_SetString(ModuleError, "invalid kind argument, must be one of \"encoder\", \"decoder\", \"echo\", \"preprocess\", \"resampler\", \"opus_encoder\" or \"opus_decoder\"");
+        return NULL;
+    }
+    
+    std::vector<void*>& idle = state_pool[pool_key(type, a, b)];
+    while (idle.size() < (unsigned int) count) {
+        void* value = NULL;
+        int err = 0;
+        switch (type) {
+        case TYPE_ENCODER:
+            value = speex_encoder_init(speex_mode(a));
+            break;
+        case TYPE_DECODER:
+            value = speex_decoder_init(speex_mode(a));
+            break;
+        case TYPE_ECHO:
+            value = speex_echo_state_init(a, b);
+            break;
+        case TYPE_PREPROCESS:
+            value = speex_preprocess_state_init(a, b);
+            break;
+#ifdef HAVE_OPUS
+        case TYPE_OPUS_ENCODER:
+            value = opus_encoder_create(a, b & 3, b >> 2, &err);
+            break;
+        case TYPE_OPUS_DECODER:
+            value = opus_decoder_create(a, b, &err);
+            break;
+#endif
+        }
+        if (value == NULL || err != 0) {
+            if (value != NULL)
+                pool_destroy(type, value);
+            break;
+        }
+        idle.push_back(value);
+        ++added;
+    }
+    return Py_BuildValue("i", added);
+}
+
+static PyObject*
+pyaudio_pool_stats(PyObject* self, PyObject* unused)
+{
+    unsigned long idle = 0;
+    for (std::map<unsigned long long, std::vector<void*> >::iterator it = state_pool.begin(); it != state_pool.end(); ++it) {
+        idle += it->second.size();
+    }
+    return Py_BuildValue("{sIsksksksksk}", "max_idle", pool_max_idle, "idle", idle,
+                         "hits", pool_hits, "misses", pool_misses, "returns", pool_returns, "discards", pool_discards);
+}
+
+
+/* Gains are applied in Q12 fixed point, so that unity gain is exact. The maximum gain keeps
+   the product of a sample and its gain within an int. */
+#define MIX_GAIN_SHIFT 12
+#define MIX_GAIN_UNITY (1 << MIX_GAIN_SHIFT)
+#define MIX_MAX_GAIN 8.0
+
+static inline short
+saturate16(int value)
+{
+    return (short) (value > 32767 ? 32767 : (value < -32768 ? -32768 : value));
+}
+
+static int
+state_sequence_check(PyObject* seq, Py_ssize_t count, int type, const char* name)
+{
+    if (PySequence_Fast_GET_SIZE(seq) != count) {
+        PyErr_Format(ModuleError, "invalid %s argument, must have one state per fragment", name);
+        return -1;
+    }
+    for (Py_ssize_t i=0; i<count; ++i) {
+        PyObject* item = PySequence_Fast_GET_ITEM(seq, i);
+        if (!PyObject_TypeCheck(item, &StateType) || ((State*)item)->type != type || ((State*)item)->value == NULL) {
+            PyErr_Format(ModuleError, "invalid %s argument, item %d is not a %s state", name, (int) i,
+                         type == TYPE_ENCODER ? "encoder" : "decoder");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static PyObject*
+mix_frames(PyObject* fragments, PyObject* gains, PyObject* decoders, PyObject* encoders)
+{
+    Py_ssize_t count = PySequence_Fast_GET_SIZE(fragments);
+    std::vector<int> gain(count, MIX_GAIN_UNITY);
+    std::vector<Fragment> inputs(count);
+    
+    for (Py_ssize_t i=0; i<count; ++i) {
+        if (inputs[i].parse(PySequence_Fast_GET_ITEM(fragments, i), "fragments", decoders == NULL) < 0) {
+            return NULL;
+        }
+        if (gains != NULL) {
+            double value = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(gains, i));
+            if (value == -1.0 && PyErr_Occurred()) {
+                return NULL;
+            }
+            if (!(value >= -MIX_MAX_GAIN && value <= MIX_MAX_GAIN)) { // also rejects NaN
+                PyErr_Format(ModuleError, "invalid gains argument, item %d must be between -8 and 8", (int) i);
+                return NULL;
+            }
+            gain[i] = (int) (value * MIX_GAIN_UNITY + (value < 0 ? -0.5 : 0.5));
+        }
+    }
+    
+    // all the inputs are mixed at a common frame size, and shorter or missing fragments are padded with silence
+    int frame_size = 0;
+    for (Py_ssize_t i=0; i<count; ++i) {
+        int size = 0;
+        if (decoders != NULL) {
+            speex_decoder_ctl(((State*)PySequence_Fast_GET_ITEM(decoders, i))->value, SPEEX_GET_FRAME_SIZE, &size);
+        }
+        else {
+            size = inputs[i].count();
+        }
+        if (decoders != NULL && i > 0 && size != frame_size) {
+            PyErr_SetString(ModuleError, "invalid decoders argument, all decoders must have the same frame size");
+            return NULL;
+        }
+        if (size > frame_size) {
+            frame_size = size;
+        }
+    }
+    
+    // each encoder reads a whole frame of its own size from the mixed output
+    if (encoders != NULL) {
+        for (Py_ssize_t i=0; i<count; ++i) {
+            int size = 0;
+            speex_encoder_ctl(((State*)PySequence_Fast_GET_ITEM(encoders, i))->value, SPEEX_GET_FRAME_SIZE, &size);
+            if (size != frame_size) {
+                PyErr_Format(ModuleError, "invalid encoders argument, item %d has frame size %d instead of %d",
+                             (int) i, size, frame_size);
+                return NULL;
+            }
+        }
+    }
+    
+    std::vector<short> frames(count * frame_size + 1, 0);
+    for (Py_ssize_t i=0; i<count; ++i) {
+        const Fragment& input = inputs[i];
+        short* frame = &frames[i * frame_size];
+        if (decoders != NULL) {
+            // an empty fragment means a lost packet, which the decoder conceals
+            State* state = (State*) PySequence_Fast_GET_ITEM(decoders, i);
+            if (input.size > 0) {
+                speex_bits_read_from(&state->bits, (char*) input.data, input.size);
+                speex_decode_int(state->value, &state->bits, frame);
+            }
+            else {
+                speex_decode_int(state->value, NULL, frame);
+            }
+        }
+        else {
+            memcpy(frame, input.data, input.count() * 2);
+        }
+    }
+    
+    // single pass over all the inputs to get the full mix, from which each participant's own input is subtracted
+    std::vector<int> sum(frame_size + 1, 0);
+    for (Py_ssize_t i=0; i<count; ++i) {
+        const short* frame = &frames[i * frame_size];
+        int g = gain[i];
+        if (g == MIX_GAIN_UNITY) {
+            for (int j=0; j<frame_size; ++j)
+                sum[j] += frame[j];
+        }
+        else {
+            for (int j=0; j<frame_size; ++j)
+                sum[j] += (frame[j] * g) >> MIX_GAIN_SHIFT;
+        }
+    }
+    
+    PyObject* mixed = PyString_FromStringAndSize(NULL, frame_size * 2);
+    PyObject* outputs = PyTuple_New(count);
+    if (mixed == NULL || outputs == NULL) {
+        Py_XDECREF(mixed);
+        Py_XDECREF(outputs);
+        return NULL;
+    }
+    
+    short* mixed_frame = (short*) PyString_AS_STRING(mixed);
+    for (int j=0; j<frame_size; ++j)
+        mixed_frame[j] = saturate16(sum[j]);
+    
+    std::vector<short> scratch(frame_size + 1);
+    for (Py_ssize_t i=0; i<count; ++i) {
+        const short* frame = &frames[i * frame_size];
+        int g = gain[i];
+        PyObject* output = NULL;
+        short* out_frame = &scratch[0];
+        if (encoders == NULL) {
+            output = PyString_FromStringAndSize(NULL, frame_size * 2);
+            if (output == NULL) {
+                Py_DECREF(mixed);
+                Py_DECREF(outputs);
+                return NULL;
+            }
+            out_frame = (short*) PyString_AS_STRING(output);
+        }
+        
+        if (g == MIX_GAIN_UNITY) {
+            for (int j=0; j<frame_size; ++j)
+                out_frame[j] = saturate16(sum[j] - frame[j]);
+        }
+        else {
+            for (int j=0; j<frame_size; ++j)
+                out_frame[j] = saturate16(sum[j] - ((frame[j] * g) >> MIX_GAIN_SHIFT));
+        }
+        
+        if (encoders != NULL) {
+            State* state = (State*) PySequence_Fast_GET_ITEM(encoders, i);
+            speex_bits_reset(&state->bits);
+            speex_encode_int(state->value, out_frame, &state->bits);
+            int output_size = speex_bits_nbytes(&state->bits);
+            output = PyString_FromStringAndSize(NULL, output_size);
+            if (output == NULL) {
+                Py_DECREF(mixed);
+                Py_DECREF(outputs);
+                return NULL;
+            }
+            output_size = speex_bits_write(&state->bits, PyString_AS_STRING(output), output_size);
+            if (output_size != PyString_GET_SIZE(output)) {
+                _PyString_Resize(&output, output_size);
+            }
+        }
+        PyTuple_SET_ITEM(outputs, i, output);
+    }
+    
+    return Py_BuildValue("(NN)", mixed, outputs);
+}
+
+static PyObject*
+pyaudio_mix(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+    PyObject* fragments = NULL;
+    PyObject* gains = Py_None;
+    PyObject* decoders = Py_None;
+    PyObject* encoders = Py_None;
+    
+    static const char *kwlist[] = {
+        "fragments", "gains", "decoders", "encoders",
+    NULL};
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|OOO", (char **)kwlist,
+            &fragments, &gains, &decoders, &encoders)) {
+        return NULL;
+    }
+    
+    PyObject* fragments_seq = PySequence_Fast(fragments, "invalid fragments argument, must be a sequence");
+    PyObject* gains_seq = NULL, *decoders_seq = NULL, *encoders_seq = NULL;
+    PyObject* result = NULL;
+    if (fragments_seq == NULL) {
+        return NULL;
+    }
+    Py_ssize_t count = PySequence_Fast_GET_SIZE(fragments_seq);
+    
+    if (gains != Py_None) {
+        gains_seq = PySequence_Fast(gains, "invalid gains argument, must be a sequence");
+        if (gains_seq == NULL) {
+            goto done;
+        }
+        if (PySequence_Fast_GET_SIZE(gains_seq) != count) {
+            PyErr_SetString(ModuleError, "invalid gains argument, must have one gain per fragment");
+            goto done;
+        }
+    }
+    if (decoders != Py_None) {
+        decoders_seq = PySequence_Fast(decoders, "invalid decoders argument, must be a sequence");
+        if (decoders_seq == NULL || state_sequence_check(decoders_seq, count, TYPE_DECODER, "decoders") < 0) {
+            goto done;
+        }
+    }
+    if (encoders != Py_None) {
+        encoders_seq = PySequence_Fast(encoders, "invalid encoders argument, must be a sequence");
+        if (encoders_seq == NULL || state_sequence_check(encoders_seq, count, TYPE_ENCODER, "encoders") < 0) {
+            goto done;
+        }
+    }
+    
+    result = mix_frames(fragments_seq, gains_seq, decoders_seq, encoders_seq);
+    
+done:
+    Py_DECREF(fragments_seq);
+    Py_XDECREF(gains_seq);
+    Py_XDECREF(decoders_seq);
+    Py_XDECREF(encoders_seq);
+    return result;
+}
+
+#ifdef __linux__
+
+/* Bulk transcoding of files, e.g., archives of call recordings. Each input file is memory
+   mapped and processed by one of the worker threads without the GIL, writing its output
+   as a stream through a large buffer. Speex output is Ogg encapsulated as in .spx files,
+   or raw concatenated frames, which are decodable only for constant bitrate. */
+
+#define TRANSCODE_BLOCK 4096
+#define TRANSCODE_FILE_BUFFER (1 << 20)
+#define TRANSCODE_RAW_BUFFER 1024
+#define OGG_PAGE_SIZE 4096
+
+struct TranscodeJob {
+    std::string input;
+    std::string output;
+    std::string error;
+    double duration;
+    double elapsed;
+};
+
+struct TranscodeOptions {
+    bool encode;
+    bool ogg;
+    int sample_rate;
+    int input_rate;
+    int output_rate;
+    int quality;
+    int resample_quality;
+};
+
+struct TranscodeContext {
+    std::vector<TranscodeJob>* jobs;
+    const TranscodeOptions* options;
+    pthread_mutex_t lock;
+    size_t next;
+};
+
+static double
+transcode_now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static inline unsigned int
+read_le32(const unsigned char* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int) p[3] << 24);
+}
+
+static inline unsigned short
+read_le16(const unsigned char* p)
+{
+    return (unsigned short) (p[0] | (p[1] << 8));
+}
+
+static inline void
+write_le32(unsigned char* p, unsigned int value)
+{
+    p[0] = (unsigned char) value;
+    p[1] = (unsigned char) (value >> 8);
+    p[2] = (unsigned char) (value >> 16);
+    p[3] = (unsigned char) (value >> 24);
+}
+
+/* The thread-safe message of an errno value for the worker threads. The result of strerror_r is
+   the message with the GNU one, or an error code with the XSI one that fills in the buffer. */
+static const char* strerror_result(int, const char* buffer) { return buffer; }
+static const char* strerror_result(const char* message, const char*) { return message; }
+
+static std::string
+error_message(int err)
+{
+    char buffer[256] = "";
+    return strerror_result(strerror_r(err, buffer, sizeof(buffer)), buffer);
+}
+
+/* Read only memory map of a whole file. */
+class MappedFile {
+public:
+    MappedFile() : data(NULL), size(0) {}
+    ~MappedFile() {
+        if (data != NULL && size > 0)
+            munmap((void*) data, size);
+    }
+
+    bool open(const char* path, std::string& error) {
+        int fd = ::open(path, O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            error = std::string("cannot open ") + path + ": " + error_message(errno);
+            if (fd >= 0)
+                close(fd);
+            return false;
+        }
+        size = st.st_size;
+        if (size > 0) {
+            void* mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped == MAP_FAILED) {
+                error = std::string("cannot map ") + path + ": " + error_message(errno);
+                close(fd);
+                size = 0;
+                return false;
+            }
+            data = (const unsigned char*) mapped;
+            madvise(mapped, size, MADV_SEQUENTIAL);
+        }
+        close(fd);
+        return true;
+    }
+
+    const unsigned char* data;
+    size_t size;
+};
+
+/* Find the 16-bit PCM samples in a WAV file, or return false. */
+static bool
+wav_parse(const unsigned char* data, size_t size, const unsigned char** samples, size_t* length,
+          int* sample_rate, int* channels, std::string& error)
+{
+    if (size < 12 || memcmp(data, "RIFF", 4) != 0 || memcmp(data + 8, "WAVE", 4) != 0) {
+        error = "not a WAV file";
+        return false;
+    }
+    bool has_format = false;
+    size_t offset = 12;
+    while (offset + 8 <= size) {
+        const unsigned char* chunk = data + offset;
+        size_t chunk_size = read_le32(chunk + 4);
+        if (memcmp(chunk, "fmt ", 4) == 0 && chunk_size >= 16 && offset + 8 + 16 <= size) {
+            if (read_le16(chunk + 8) != 1 || read_le16(chunk + 22) != 16) {
+                error = "unsupported WAV format, must be 16-bit PCM";
+                return false;
+            }
+            *channels = read_le16(chunk + 10);
+            *sample_rate = read_le32(chunk + 12);
+            has_format = true;
+        }
+        else if (memcmp(chunk, "data", 4) == 0) {
+            if (!has_format) {
+                break;
+            }
+            *samples = chunk + 8;
+            *length = chunk_size < size - offset - 8 ? chunk_size : size - offset - 8;
+            return true;
+        }
+        offset += 8 + chunk_size + (chunk_size & 1);
+    }
+    error = "invalid WAV file, missing fmt or data chunk";
+    return false;
+}
+
+static unsigned int ogg_crc_table[256];
+
+/* Initialize the CRC table once at module initialization. */
+static void
+ogg_crc_init()
+{
+    for (unsigned int i=0; i<256; ++i) {
+        unsigned int r = i << 24;
+        for (int j=0; j<8; ++j)
+            r = (r & 0x80000000) ? (r << 1) ^ 0x04c11db7 : (r << 1);
+        ogg_crc_table[i] = r;
+    }
+}
+
+static unsigned int
+ogg_crc(const unsigned char* data, size_t size)
+{
+    unsigned int crc = 0;
+    for (size_t i=0; i<size; ++i)
+        crc = (crc << 8) ^ ogg_crc_table[((crc >> 24) ^ data[i]) & 0xff];
+    return crc;
+}
+
+/* Minimal Ogg stream writer, with packets no larger than a page. */
+class OggWriter {
+public:
+    OggWriter(FILE* file, unsigned int serial) : file(file), serial(serial), sequence(0), granule(0), segments(0), body_size(0) {}
+
+    /* Add a packet, flushing it on a page of its own if alone is set. */
+    void packet(const unsigned char* data, int size, long long granule, bool alone) {
+        if (segments + size / 255 + 1 > 255 || body_size + size > OGG_PAGE_SIZE)
+            flush(false);
+        while (true) {
+            int lacing = size > 255 ? 255 : size;
+            table[segments++] = (unsigned char) lacing;
+            memcpy(body + body_size, data, lacing);
+            body_size += lacing;
+            data += lacing;
+            size -= lacing;
+            if (lacing < 255)
+                break;
+        }
+        this->granule = granule;
+        if (alone)
+            flush(false);
+    }
+
+    /* Write the pending packets as a page, which is written even if empty to end the stream. */
+    void flush(bool last) {
+        if (segments == 0 && !last)
+            return;
+        memcpy(page, "OggS", 4);
+        page[4] = 0;
+        page[5] = (sequence == 0 ? 0x02 : 0) | (last ? 0x04 : 0);
+        write_le32(page + 6, (unsigned int) granule);
+        write_le32(page + 10, (unsigned int) (granule >> 32));
+        write_le32(page + 14, serial);
+        write_le32(page + 18, sequence++);
+        write_le32(page + 22, 0);
+        page[26] = (unsigned char) segments;
+        memcpy(page + 27, table, segments);
+        memcpy(page + 27 + segments, body, body_size);
+        size_t size = 27 + segments + body_size;
+        write_le32(page + 22, ogg_crc(page, size));
+        fwrite(page, 1, size, file);
+        segments = 0;
+        body_size = 0;
+    }
+
+private:
+    FILE* file;
+    unsigned int serial;
+    unsigned int sequence;
+    long long granule;
+    int segments;
+    int body_size;
+    unsigned char table[255];
+    unsigned char body[OGG_PAGE_SIZE];
+    unsigned char page[27 + 255 + OGG_PAGE_SIZE];
+};
+
+/* Minimal Ogg stream reader of the first logical stream in memory. */
+class OggReader {
+public:
+    OggReader(const unsigned char* data, size_t size) : data(data), size(size), offset(0), segment(0), segments(0), page(NULL) {}
+
+    bool packet(std::vector<unsigned char>& out) {
+        out.clear();
+        while (true) {
+            if (segment >= segments && !next_page())
+                return false;
+            while (segment < segments) {
+                int lacing = page[27 + segment++];
+                out.insert(out.end(), body, body + lacing);
+                body += lacing;
+                if (lacing < 255)
+                    return true;
+            }
+        }
+    }
+
+private:
+    bool next_page() {
+        while (offset + 27 <= size) {
+            const unsigned char* p = data + offset;
+            if (memcmp(p, "OggS", 4) != 0) {
+                ++offset;
+                continue;
+            }
+            int count = p[26];
+            size_t body_size = 0;
+            if (offset + 27 + count > size)
+                return false;
+            for (int i=0; i<count; ++i)
+                body_size += p[27 + i];
+            if (offset + 27 + count + body_size > size)
+                return false;
+            page = p;
+            body = p + 27 + count;
+            segment = 0;
+            segments = count;
+            offset += 27 + count + body_size;
+            return true;
+        }
+        return false;
+    }
+
+    const unsigned char* data;
+    size_t size;
+    size_t offset;
+    int segment;
+    int segments;
+    const unsigned char* page;
+    const unsigned char* body;
+};
+
+/* Start an Ogg Speex stream with its header and comment packets, one frame per packet. */
+static OggWriter*
+ogg_speex_create(FILE* file, int sample_rate)
+{
+    OggWriter* ogg = new OggWriter(file, random32());
+    SpeexHeader header;
+    speex_init_header(&header, sample_rate, 1, speex_mode(sample_rate));
+    header.frames_per_packet = 1;
+    int header_size = 0;
+    char* header_packet = speex_header_to_packet(&header, &header_size);
+    ogg->packet((unsigned char*) header_packet, header_size, 0, true);
+    speex_header_free(header_packet);
+
+    static const char vendor[] = "py-audio audiospeex";
+    unsigned char comments[8 + sizeof(vendor)];
+    write_le32(comments, sizeof(vendor) - 1);
+    memcpy(comments + 4, vendor, sizeof(vendor) - 1);
+    write_le32(comments + 4 + sizeof(vendor) - 1, 0);
+    ogg->packet(comments, 8 + sizeof(vendor) - 1, 0, true);
+    return ogg;
+}
+
+static bool
+transcode_encode(TranscodeJob& job, const TranscodeOptions& options, const MappedFile& input, FILE* file)
+{
+    const unsigned char* samples = input.data;
+    size_t length = input.size;
+    int input_rate = options.input_rate, channels = 1;
+    if (length >= 12 && memcmp(input.data, "RIFF", 4) == 0) {
+        if (!wav_parse(input.data, input.size, &samples, &length, &input_rate, &channels, job.error))
+            return false;
+    }
+    if (input_rate <= 0 || channels < 1) {
+        job.error = "missing input_rate for raw input";
+        return false;
+    }
+    size_t count = length / (2 * channels);
+    job.duration = (double) count / input_rate;
+
+    SpeexResamplerState* resampler = NULL;
+    if (input_rate != options.sample_rate) {
+        int err = 0;
+        resampler = speex_resampler_init(1, input_rate, options.sample_rate, options.resample_quality, &err);
+        if (resampler == NULL) {
+            job.error = "failed to create resampler state";
+            return false;
+        }
+        speex_resampler_skip_zeros(resampler);
+    }
+    void* encoder = speex_encoder_init(speex_mode(options.sample_rate));
+    if (encoder == NULL) {
+        job.error = "failed to create encoder state";
+        if (resampler != NULL)
+            speex_resampler_destroy(resampler);
+        return false;
+    }
+    int frame_size = 0;
+    speex_encoder_ctl(encoder, SPEEX_GET_FRAME_SIZE, &frame_size);
+    if (options.quality >= 0) {
+        int quality = options.quality;
+        speex_encoder_ctl(encoder, SPEEX_SET_QUALITY, &quality);
+    }
+    SpeexBits bits;
+    speex_bits_init(&bits);
+
+    OggWriter* ogg = NULL;
+    if (options.ogg) {
+        ogg = ogg_speex_create(file, options.sample_rate);
+    }
+
+    short block[TRANSCODE_BLOCK];
+    // a block, or the resampler tail of latency zeros which is shorter, resamples to at most this size
+    size_t resampled_size = (size_t) ((unsigned long long) TRANSCODE_BLOCK * options.sample_rate / input_rate) + 64;
+    std::vector<short> pending;
+    pending.reserve(resampled_size + frame_size);
+    std::vector<short> resampled(resampled_size);
+    char packet[2000];
+    long long granule = 0;
+    size_t position = 0;
+
+    while (position < count || !pending.empty()) {
+        bool last = position >= count;
+        if (!last) {
+            size_t block_size = count - position < TRANSCODE_BLOCK ? count - position : TRANSCODE_BLOCK;
+            const unsigned char* p = samples + position * 2 * channels;
+            for (size_t i=0; i<block_size; ++i) {
+                int sum = 0;
+                for (int c=0; c<channels; ++c)
+                    sum += (short) read_le16(p + (i * channels + c) * 2);
+                block[i] = (short) (sum / channels);
+            }
+            position += block_size;
+            last = position >= count;
+            if (resampler != NULL) {
+                spx_uint32_t input_size = block_size, output_size = resampled.size();
+                speex_resampler_process_int(resampler, 0, block, &input_size, &resampled[0], &output_size);
+                pending.insert(pending.end(), resampled.begin(), resampled.begin() + output_size);
+                if (last) {
+                    // flush the tail of the resampler filter
+                    int latency = speex_resampler_get_input_latency(resampler);
+                    if (latency > TRANSCODE_BLOCK)
+                        latency = TRANSCODE_BLOCK;
+                    memset(block, 0, latency * 2);
+                    input_size = latency;
+                    output_size = resampled.size();
+                    speex_resampler_process_int(resampler, 0, block, &input_size, &resampled[0], &output_size);
+                    pending.insert(pending.end(), resampled.begin(), resampled.begin() + output_size);
+                }
+            }
+            else {
+                pending.insert(pending.end(), block, block + block_size);
+            }
+        }
+        if (last && pending.size() % frame_size != 0) {
+            // pad the last frame with silence
+            pending.resize(pending.size() + frame_size - pending.size() % frame_size, 0);
+        }
+
+        size_t offset = 0;
+        for (; offset + frame_size <= pending.size(); offset += frame_size) {
+            speex_bits_reset(&bits);
+            speex_encode_int(encoder, &pending[offset], &bits);
+            speex_bits_insert_terminator(&bits);
+            int packet_size = speex_bits_write(&bits, packet, sizeof(packet));
+            granule += frame_size;
+            if (ogg != NULL)
+                ogg->packet((unsigned char*) packet, packet_size, granule, false);
+            else
+                fwrite(packet, 1, packet_size, file);
+        }
+        pending.erase(pending.begin(), pending.begin() + offset);
+    }
+    if (ogg != NULL) {
+        ogg->flush(true);
+        delete ogg;
+    }
+
+    speex_bits_destroy(&bits);
+    if (resampler != NULL)
+        speex_resampler_destroy(resampler);
+    speex_encoder_destroy(encoder);
+    return true;
+}
+
+static bool
+transcode_decode(TranscodeJob& job, const TranscodeOptions& options, const MappedFile& input, FILE* file)
+{
+    int sample_rate = options.sample_rate;
+    int frames_per_packet = 1;
+    OggReader* ogg = NULL;
+    std::vector<unsigned char> packet;
+
+    if (options.ogg) {
+        ogg = new OggReader(input.data, input.size);
+        SpeexHeader* header = NULL;
+        if (ogg->packet(packet) && !packet.empty()) {
+            header = speex_packet_to_header((char*) &packet[0], packet.size());
+        }
+        if (header == NULL || header->mode < 0 || header->mode > 2) {
+            job.error = "not an Ogg Speex file";
+            if (header != NULL)
+                speex_header_free(header);
+            delete ogg;
+            return false;
+        }
+        sample_rate = header->mode == 0 ? 8000 : (header->mode == 1 ? 16000 : 32000);
+        frames_per_packet = header->frames_per_packet > 0 ? header->frames_per_packet : 1;
+        speex_header_free(header);
+        ogg->packet(packet); // comments
+    }
+
+    int output_rate = options.output_rate > 0 ? options.output_rate : sample_rate;
+    SpeexResamplerState* resampler = NULL;
+    if (output_rate != sample_rate) {
+        int err = 0;
+        resampler = speex_resampler_init(1, sample_rate, output_rate, options.resample_quality, &err);
+        if (resampler == NULL) {
+            job.error = "failed to create resampler state";
+            delete ogg;
+            return false;
+        }
+        speex_resampler_skip_zeros(resampler);
+    }
+    void* decoder = speex_decoder_init(speex_mode(sample_rate));
+    if (decoder == NULL) {
+        job.error = "failed to create decoder state";
+        if (resampler != NULL)
+            speex_resampler_destroy(resampler);
+        delete ogg;
+        return false;
+    }
+    int frame_size = 0;
+    speex_decoder_ctl(decoder, SPEEX_GET_FRAME_SIZE, &frame_size);
+    SpeexBits bits;
+    speex_bits_init(&bits);
+
+    record_wav_header(file, output_rate, 1, 0);
+    unsigned int data_size = 0;
+    size_t decoded = 0;
+    std::vector<short> frame(frame_size);
+    std::vector<short> resampled((size_t) ((unsigned long long) frame_size * output_rate / sample_rate) + 64);
+
+    size_t offset = 0;
+    while (true) {
+        int frames = frames_per_packet;
+        if (ogg != NULL) {
+            if (!ogg->packet(packet))
+                break;
+            if (packet.empty())
+                continue;
+            speex_bits_read_from(&bits, (char*) &packet[0], packet.size());
+        }
+        else {
+            // keep a few frames worth of raw input in the bits, which discards the consumed bytes
+            if (offset < input.size && speex_bits_remaining(&bits) < TRANSCODE_RAW_BUFFER * 8 / 2) {
+                int size = input.size - offset < TRANSCODE_RAW_BUFFER / 2 ? input.size - offset : TRANSCODE_RAW_BUFFER / 2;
+                speex_bits_read_whole_bytes(&bits, (char*) input.data + offset, size);
+                offset += size;
+            }
+            frames = 1;
+            if (speex_bits_remaining(&bits) < 5)
+                break;
+        }
+        int i = 0;
+        for (; i<frames; ++i) {
+            if (speex_decode_int(decoder, &bits, &frame[0]) != 0)
+                break;
+            if (ogg == NULL) {
+                // each raw frame is padded with a terminator to whole bytes
+                speex_bits_advance(&bits, speex_bits_remaining(&bits) % 8);
+            }
+            decoded += frame_size;
+            const short* output = &frame[0];
+            spx_uint32_t output_size = frame_size;
+            if (resampler != NULL) {
+                spx_uint32_t input_size = frame_size;
+                output_size = resampled.size();
+                speex_resampler_process_int(resampler, 0, &frame[0], &input_size, &resampled[0], &output_size);
+                output = &resampled[0];
+            }
+            fwrite(output, 2, output_size, file);
+            data_size += output_size * 2;
+        }
+        if (ogg == NULL && i < frames)
+            break; // corrupt or truncated raw input, which cannot be resynchronized
+    }
+    if (resampler != NULL) {
+        // flush the tail of the resampler filter
+        std::vector<short> zeros(speex_resampler_get_input_latency(resampler), 0);
+        size_t position = 0;
+        while (position < zeros.size()) {
+            spx_uint32_t input_size = zeros.size() - position, output_size = resampled.size();
+            speex_resampler_process_int(resampler, 0, &zeros[position], &input_size, &resampled[0], &output_size);
+            fwrite(&resampled[0], 2, output_size, file);
+            data_size += output_size * 2;
+            if (input_size == 0)
+                break;
+            position += input_size;
+        }
+    }
+    job.duration = (double) decoded / sample_rate;
+
+    fseek(file, 0, SEEK_SET);
+    record_wav_header(file, output_rate, 1, data_size);
+
+    delete ogg;
+    speex_bits_destroy(&bits);
+    if (resampler != NULL)
+        speex_resampler_destroy(resampler);
+    speex_decoder_destroy(decoder);
+    return true;
+}
+
+static void*
+transcode_run(void* arg)
+{
+    TranscodeContext* context = (TranscodeContext*) arg;
+    std::vector<char> buffer(TRANSCODE_FILE_BUFFER);
+
+    while (true) {
+        pthread_mutex_lock(&context->lock);
+        size_t index = context->next++;
+        pthread_mutex_unlock(&context->lock);
+        if (index >= context->jobs->size())
+            break;
+
+        TranscodeJob& job = (*context->jobs)[index];
+        double start = transcode_now();
+        MappedFile input;
+        if (input.open(job.input.c_str(), job.error)) {
+            FILE* file = fopen(job.output.c_str(), "wb");
+            if (file == NULL) {
+                job.error = "cannot create " + job.output + ": " + error_message(errno);
+            }
+            else {
+                setvbuf(file, &buffer[0], _IOFBF, buffer.size());
+                bool ok = context->options->encode ? transcode_encode(job, *context->options, input, file)
+                                                   : transcode_decode(job, *context->options, input, file);
+                if (fclose(file) != 0 && ok)
+                    job.error = "cannot write " + job.output + ": " + error_message(errno);
+            }
+        }
+        job.elapsed = transcode_now() - start;
+    }
+    return NULL;
+}
+
+static PyObject*
+pyaudio_transcode(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+    PyObject* jobs = NULL;
+    const char* mode = "encode";
+    const char* container = "ogg";
+    TranscodeOptions options;
+    int threads = 0;
+    options.sample_rate = 8000;
+    options.input_rate = 0;
+    options.output_rate = 0;
+    options.quality = -1;
+    options.resample_quality = 5;
+
+    static const char *kwlist[] = {
+        "jobs", "mode", "container", "sample_rate", "input_rate", "output_rate", "quality", "resample_quality", "threads",
+    NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|ssiiiiii", (char **)kwlist,
+            &jobs, &mode, &container, &options.sample_rate, &options.input_rate, &options.output_rate,
+            &options.quality, &options.resample_quality, &threads)) {
+        return NULL;
+    }
+
+    if (strcmp(mode, "encode") != 0 && strcmp(mode, "decode") != 0) {
+        PyErr_SetString(ModuleError, "invalid mode argument, must be \"encode\" or \"decode\"");
+        return NULL;
+    }
+    if (strcmp(container, "ogg") != 0 && strcmp(container, "raw") != 0) {
+        PyErr_SetString(ModuleError, "invalid container argument, must be \"ogg\" or \"raw\"");
+        return NULL;
+    }
+    options.encode = mode[0] == 'e';
+    options.ogg = container[0] == 'o';
+    if ((options.encode || !options.ogg)
+        && options.sample_rate != 8000 && options.sample_rate != 16000 && options.sample_rate != 32000) {
+        PyErr_SetString(ModuleError, "invalid sample_rate argument, must be 8000, 16000 or 32000");
+        return NULL;
+    }
+    if (options.resample_quality < 0 || options.resample_quality > 10) {
+        PyErr_SetString(ModuleError, "invalid resample_quality argument, must be between 0 and 10");
+        return NULL;
+    }
+
+    PyObject* seq = PySequence_Fast(jobs, "invalid jobs argument, must be a sequence of (input, output) paths");
+    if (seq == NULL) {
+        return NULL;
+    }
+    std::vector<TranscodeJob> items(PySequence_Fast_GET_SIZE(seq));
+    for (size_t i=0; i<items.size(); ++i) {
+        const char* input = NULL, *output = NULL;
+        PyObject* item = PySequence_Fast_GET_ITEM(seq, i);
+        if (!PyTuple_Check(item) || !PyArg_ParseTuple(item, "ss", &input, &output)) {
+            PyErr_Clear();
+            PyErr_SetString(ModuleError, "invalid jobs argument, must be a sequence of (input, output) paths");
+            Py_DECREF(seq);
+            return NULL;
+        }
+        items[i].input = input;
+        items[i].output = output;
+        items[i].duration = items[i].elapsed = 0;
+    }
+    Py_DECREF(seq);
+
+    if (threads <= 0) {
+        threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (threads > (int) items.size()) {
+        threads = items.size();
+    }
+
+    TranscodeContext context;
+    context.jobs = &items;
+    context.options = &options;
+    context.next = 0;
+    pthread_mutex_init(&context.lock, NULL);
+    double start = transcode_now();
+
+    Py_BEGIN_ALLOW_THREADS
+    std::vector<pthread_t> workers;
+    for (int i=1; i<threads; ++i) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, transcode_run, &context) == 0)
+            workers.push_back(thread);
+    }
+    transcode_run(&context);
+    for (unsigned i=0; i<workers.size(); ++i) {
+        pthread_join(workers[i], NULL);
+    }
+    Py_END_ALLOW_THREADS
+
+    double elapsed = transcode_now() - start;
+    pthread_mutex_destroy(&context.lock);
+
+    double duration = 0;
+    PyObject* results = PyList_New(items.size());
+    for (size_t i=0; i<items.size(); ++i) {
+        const TranscodeJob& job = items[i];
+        PyObject* error = job.error.empty() ? (Py_INCREF(Py_None), Py_None) : PyString_FromString(job.error.c_str());
+        PyList_SET_ITEM(results, i, Py_BuildValue("{sssssdsdsN}", "input", job.input.c_str(), "output", job.output.c_str(),
+                                                  "duration", job.duration, "elapsed", job.elapsed, "error", error));
+        duration += job.duration;
+    }
+    return Py_BuildValue("(N{sdsdsd})", results, "duration", duration, "elapsed", elapsed,
+                         "realtime_factor", elapsed > 0 ? duration / elapsed : 0.0);
+}
+
+/* Recording tap of a pipeline, e.g., for call recording. The record function only copies the
+   fragment in the recording ring, and its writer thread drains the ring to a WAV or Ogg Speex
+   file. The caller never waits for the disk, and the fragments that do not fit in the ring are
+   dropped and counted instead. */
+
+#define RECORD_CHUNK_FRAMES 8192
+
+struct Recorder {
+    FILE* file;
+    RecordRing ring;
+    bool failed;
+    int sample_rate;
+    int channels;
+    unsigned int data_size;
+    std::vector<char> buffer;  // stdio buffer of the file
+    void* encoder;             // Speex encoder of the writer thread, if any
+    SpeexBits bits;
+    OggWriter* ogg;
+    std::vector<short> pending;
+    long long granule;
+    int frame_size;
+};
+
+/* Encode the complete frames pending in the writer thread, and pad the last one if done. */
+static void
+recorder_encode(Recorder* recorder, bool done)
+{
+    std::vector<short>& pending = recorder->pending;
+    if (done && pending.size() % recorder->frame_size != 0) {
+        pending.resize(pending.size() + recorder->frame_size - pending.size() % recorder->frame_size, 0);
+    }
+    char packet[2000];
+    size_t offset = 0;
+    for (; offset + recorder->frame_size <= pending.size(); offset += recorder->frame_size) {
+        speex_bits_reset(&recorder->bits);
+        speex_encode_int(recorder->encoder, &pending[offset], &recorder->bits);
+        speex_bits_insert_terminator(&recorder->bits);
+        int packet_size = speex_bits_write(&recorder->bits, packet, sizeof(packet));
+        recorder->granule += recorder->frame_size;
+        recorder->ogg->packet((unsigned char*) packet, packet_size, recorder->granule, false);
+    }
+    pending.erase(pending.begin(), pending.begin() + offset);
+    if (done) {
+        recorder->ogg->flush(true);
+    }
+}
+
+/* Write a chunk drained from the ring, on the writer thread. The chunks are whole frames since
+   the ring, chunk and fragment sizes are all multiples of the frame size. */
+static void
+recorder_write(void* context, char* data, size_t size)
+{
+    Recorder* recorder = (Recorder*) context;
+    if (recorder->encoder == NULL) {
+        if (fwrite(data, 1, size, recorder->file) != size)
+            recorder->failed = true;
+        recorder->data_size += size;
+    }
+    else {
+        // downmix to mono for the encoder
+        const short* samples = (const short*) data;
+        size_t frames = size / (recorder->channels * 2);
+        for (size_t i=0; i<frames; ++i) {
+            int sum = 0;
+            for (int c=0; c<recorder->channels; ++c)
+                sum += samples[i * recorder->channels + c];
+            recorder->pending.push_back((short) (sum / recorder->channels));
+        }
+        recorder_encode(recorder, false);
+    }
+}
+
+/* Stop the writer thread after it drains the ring, complete the file and delete the recorder.
+   Return false if writing the file failed. Call it without the GIL, since it waits for the disk. */
+static bool
+recorder_close(Recorder* recorder)
+{
+    record_ring_stop(&recorder->ring);
+
+    if (recorder->encoder != NULL) {
+        recorder_encode(recorder, true);
+        delete recorder->ogg;
+        speex_bits_destroy(&recorder->bits);
+        speex_encoder_destroy(recorder->encoder);
+    }
+    else {
+        fseek(recorder->file, 0, SEEK_SET);
+        record_wav_header(recorder->file, recorder->sample_rate, recorder->channels, recorder->data_size);
+    }
+    bool failed = ferror(recorder->file) || recorder->failed;
+    if (fclose(recorder->file) != 0)
+        failed = true;
+    delete recorder;
+    return !failed;
+}
+
+static PyObject*
+pyaudio_record(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+    PyObject* input = NULL;
+    const char* path = NULL;
+    int sample_rate = 8000;
+    int channels = 1;
+    const char* format = "wav";
+    int quality = -1;
+    int ring_duration = 2000; // in milliseconds
+    PyObject* state = Py_None;
+    
+    static const char *kwlist[] = {
+        "fragment", "path", "sample_rate", "channels", "format", "quality", "ring_duration", "state",
+    NULL};
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|ziisiiO", (char **)kwlist,
+            &input, &path, &sample_rate, &channels, &format, &quality, &ring_duration, &state)) {
+        return NULL;
+    }
+    
+    Fragment fragment;
+    if (fragment.parse(input, "fragment", true) < 0) {
+        return NULL;
+    }
+    
+    if (state == Py_None) {
+        bool speex = strcmp(format, "speex") == 0;
+        if (path == NULL) {
+            PyErr_SetString(ModuleError, "missing path argument");
+            return NULL;
+        }
+        if (!speex && strcmp(format, "wav") != 0) {
+            PyErr_SetString(ModuleError, "invalid format argument, must be \"wav\" or \"speex\"");
+            return NULL;
+        }
+        if (sample_rate <= 0 || (speex && sample_rate != 8000 && sample_rate != 16000 && sample_rate != 32000)) {
+            PyErr_SetString(ModuleError, "invalid sample_rate argument, must be 8000, 16000 or 32000 for speex");
+            return NULL;
+        }
+        if (channels < 1 || channels > 8 || ring_duration < 100) {
+            PyErr_SetString(ModuleError, "invalid channels or ring_duration argument");
+            return NULL;
+        }
+        
+        FILE* file = fopen(path, "wb");
+        if (file == NULL) {
+            PyErr_SetString(ModuleError, "cannot create the recording file");
+            return NULL;
+        }
+        Recorder* recorder = new Recorder();
+        recorder->file = file;
+        recorder->sample_rate = sample_rate;
+        recorder->channels = channels;
+        recorder->buffer.resize(TRANSCODE_FILE_BUFFER);
+        setvbuf(file, &recorder->buffer[0], _IOFBF, recorder->buffer.size());
+        if (speex) {
+            recorder->encoder = speex_encoder_init(speex_mode(sample_rate));
+            speex_encoder_ctl(recorder->encoder, SPEEX_GET_FRAME_SIZE, &recorder->frame_size);
+            if (quality >= 0) {
+                speex_encoder_ctl(recorder->encoder, SPEEX_SET_QUALITY, &quality);
+            }
+            speex_bits_init(&recorder->bits);
+            recorder->ogg = ogg_speex_create(file, sample_rate);
+        }
+        else {
+            record_wav_header(file, sample_rate, channels, 0);
+        }
+        if (record_ring_start(&recorder->ring, (size_t) sample_rate * ring_duration / 1000 * channels * 2,
+                              RECORD_CHUNK_FRAMES * channels * 2, recorder_write, recorder) != 0) {
+            if (recorder->encoder != NULL) {
+                delete recorder->ogg;
+                speex_bits_destroy(&recorder->bits);
+                speex_encoder_destroy(recorder->encoder);
+            }
+            fclose(file);
+            delete recorder;
+            PyErr_SetString(ModuleError, "cannot create the recording thread");
+            return NULL;
+        }
+        
+        state = State_new(&StateType, NULL, NULL);
+        ((State*)state)->type = TYPE_RECORDER;
+        ((State*)state)->channels = channels;
+        ((State*)state)->recorder = recorder;
+    }
+    else if (!PyObject_TypeCheck(state, &StateType) || ((State*)state)->type != TYPE_RECORDER) {
+        PyErr_SetString(ModuleError, "invalid state argument, not a recorder state");
+        return NULL;
+    }
+    else if (((State*)state)->recorder == NULL) {
+        PyErr_SetString(ModuleError, "invalid state argument, recorder is closed");
+        return NULL;
+    }
+    else {
+        Py_XINCREF(state);
+    }
+    
+    State* recorder_state = (State*) state;
+    int frames = fragment.count() / recorder_state->channels;
+    int dropped = 0;
+    if (frames > 0) {
+        if (record_ring_put(&recorder_state->recorder->ring, fragment.samples(), frames * recorder_state->channels * 2)) {
+            recorder_state->record_frames += frames;
+        }
+        else {
+            recorder_state->record_dropped += frames;
+            dropped = frames;
+        }
+    }
+    return Py_BuildValue("(iN)", dropped, state);
+}
+
+static PyObject*
+pyaudio_record_close(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+    PyObject* state = NULL;
+    
+    static const char *kwlist[] = {
+        "state",
+    NULL};
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O", (char **)kwlist, &state)) {
+        return NULL;
+    }
+    if (!PyObject_TypeCheck(state, &StateType) || ((State*)state)->type != TYPE_RECORDER) {
+        PyErr_SetString(ModuleError, "invalid state argument, not a recorder state");
+        return NULL;
+    }
+    
+    Recorder* recorder = ((State*)state)->recorder;
+    ((State*)state)->recorder = NULL;
+    if (recorder != NULL) {
+        bool ok;
+        Py_BEGIN_ALLOW_THREADS
+        ok = recorder_close(recorder);
+        Py_END_ALLOW_THREADS
+        if (!ok) {
+            PyErr_SetString(ModuleError, "failed to write the recording file");
+            return NULL;
+        }
+    }
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+#endif /* __linux__ */
+
+static PyMethodDef Module_methods[] = {
+    {"lin2speex", (PyCFunction) pyaudio_lin2speex, METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("Convert samples in the audio fragment to Speex encoding and return this as a Python string. "
+            "The optional meter state measures the levels of the input fragment.")},
+    {"speex2lin", (PyCFunction) pyaudio_speex2lin, METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("Convert the Speex encoded fragment to linear fragment and return this as a Python string. "
+            "The optional meter state measures the levels of the decoded fragment.")},
+        
+    {"resample", (PyCFunction) pyaudio_resample, METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("Convert the sampling rate of the linear fragment and return this as a Python string. "
+            "The optional meter state measures the levels of the resampled fragment.")},
+    {"resampler_stats", (PyCFunction) pyaudio_resampler_stats, METH_NOARGS,
+        PyDoc_STR("resampler_stats() -> {\"banks\": int, \"channels\": int, \"capacity\": int, \"channels_per_bank\": int}\n\n"
+            "Get the number of resampler banks, the number of resampler states using them, and their total channels. "
+            "The first resampler state of an input_rate, output_rate and quality gets a single channel bank, and "
+            "more states with the same ones share the filter table of banks of channels_per_bank channels.")},
+    {"drift_put", (PyCFunction) pyaudio_drift_put, METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("drift_put(fragment, input_rate=0, output_rate=0, target=60, max_latency=200, quality=3, state=None) -> (depth_ms, state)\n\n"
+            "Queue the linear fragment produced at the input clock, e.g., by the network or another device, for drift_get, and return the queue depth in ms.\n"
+            " target - queue depth in ms which the drift compensation keeps\n"
+            " max_latency - queue depth in ms above which the oldest samples are dropped down to the target")},
+    {"drift_get", (PyCFunction) pyaudio_drift_get, METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("drift_get(samples, state, out=None) -> (fragment, state)\n\n"
+            "Get exactly the given number of samples at the output clock, e.g., in the audiodev callback, resampled from the queue "
+            "with its ratio continuously adjusted to keep the queue depth at the target. On underrun the rest is silence. "
+            "The state has underruns, overruns and adjustment attributes.")},
+    {"preprocess", (PyCFunction) pyaudio_preprocess, METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("Apply preprocessing steps to the linear fragment and return this as a Python string. "
+            "The optional meter state measures the levels of the preprocessed fragment.")},
+    {"cancel_echo", (PyCFunction) pyaudio_cancel_echo, METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("Apply echo cancellation steps to the captured and played linear fragments and return this as a Python string.")},
+    {"meter", (PyCFunction) pyaudio_meter, METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("meter(fragment, channels=1, window=50, silence=-50.0, state=None) -> (rms, state)\n\n"
+            "Measure the levels of the linear fragment per channel in a rolling window, and return its RMS over all channels. "
+            "An empty fragment only creates the state, which can also be given as the meter argument of lin2speex, speex2lin, "
+            "resample and preprocess to measure their fragments natively.\n"
+            " channels - number of interleaved channels in the fragments, which must match the state if given\n"
+            " window - number of most recent fragments aggregated by levels\n"
+            " silence - level in dBFS below which a fragment counts as silent")},
+    {"levels", (PyCFunction) pyaudio_levels, METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("levels(state) -> (channel1, channel2, ...)\n\n"
+            "Get the levels over the window of the meter state, as a dict per channel with rms and peak in sample units, "
+            "the number of clipped samples, the silence ratio of the fragments, and the number of fragments in the window.")},
+    {"lin2rtp", (PyCFunction) pyaudio_lin2rtp, METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("lin2rtp(fragment, sample_rate=0, payload_type=97, ssrc=0, marker=False, state=None, out=None) -> (packet, state)\n\n"
+            "Convert one or more complete frames of samples to Speex encoding and return this as a ready to send RTP packet with RFC 5574 payload.\n"
+            " payload_type - RTP payload type, used only for the first packet of the state\n"
+            " ssrc - RTP synchronization source, or 0 for a random one, used only for the first packet of the state\n"
+            " marker - whether to set the marker bit, e.g., for the first packet of a talk spurt\n"
+            " state - encoder state, which tracks the sequence number and timestamp of the sent packets")},
+    {"rtp2lin", (PyCFunction) pyaudio_rtp2lin, METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("rtp2lin(packet, sample_rate=0, state=None, out=None) -> (linear, state)\n\n"
+            "Convert the received RTP packet with RFC 5574 Speex payload to linear fragment and return this as a Python string.\n"
+            " state - decoder state, which records the header of the last received packet in its timestamp, ssrc, "
+            "payload_type and marker attributes, the highest sequence number, and the received, lost and late packet counts. "
+            "A late or duplicate packet is still decoded, and does not move the sequence number back.")},
+#ifdef __linux__
+    {"relay_start", (PyCFunction) pyaudio_relay_start, METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("relay_start(threads=1)\n\n"
+            "Start the native media relay with the given number of worker threads, each polling its share of the relay channels.")},
+    {"relay_stop", (PyCFunction) pyaudio_relay_stop, METH_NOARGS,
+        PyDoc_STR("relay_stop()\n\n"
+            "Stop the native media relay, and close all its relay channels.")},
+    {"relay_add", (PyCFunction) pyaudio_relay_add, METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("relay_add(local_a, remote_a, sample_rate_a, local_b, remote_b, sample_rate_b, payload_type_a=97, payload_type_b=97, quality=3) -> (id, port_a, port_b)\n\n"
+            "Add a relay channel that transcodes RTP with Speex payload between two UDP legs a and b, and return its id and local ports.\n"
+            " local_a, local_b - (host, port) to bind, where port 0 picks any free port\n"
+            " remote_a, remote_b - (host, port) to send to, or None to send to the source of the first received packet. "
+            "Packets from any other source, or with another payload type, are dropped and counted in errors\n"
+            " sample_rate_a, sample_rate_b - Speex sampling rate of each leg, one of 8000, 16000 or 32000\n"
+            " quality - resampler quality when the sampling rates differ")},
+    {"relay_remove", (PyCFunction) pyaudio_relay_remove, METH_VARARGS,
+        PyDoc_STR("relay_remove(id)\n\n"
+            "Remove the relay channel, and close its sockets.")},
+    {"relay_stats", (PyCFunction) pyaudio_relay_stats, METH_VARARGS,
+        PyDoc_STR("relay_stats(id) -> {\"a\": dict, \"b\": dict}\n\n"
+            "Get the local_port and the received, sent, lost, late and errors packet counts of each leg of the relay channel, "
+            "and the dropped count of samples received on the leg that did not fit in the other leg's pending buffer.")},
+#endif
+#ifdef HAVE_OPUS
+    {"lin2opus", (PyCFunction) pyaudio_lin2opus, METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("lin2opus(fragment, sample_rate=0, channels=1, bitrate=0, fec=False, packet_loss=0, application=\"voip\", state=None, out=None) -> (encoded, state)\n\n"
+            "Convert samples in the audio fragment to Opus encoding and return this as a Python string.\n"
+            " fragment - linear fragment of 2.5, 5, 10, 20, 40 or 60 ms\n"
+            " sample_rate - one of 8000, 12000, 16000, 24000 or 48000, needed only when state is None\n"
+            " bitrate - target bitrate in bits per second, or 0 for the codec default\n"
+            " fec - whether to include in-band forward error correction, tuned for the expected packet_loss percentage\n"
+            " application - one of \"voip\", \"audio\" or \"lowdelay\"")},
+    {"opus2lin", (PyCFunction) pyaudio_opus2lin, METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("opus2lin(fragment, sample_rate=0, channels=1, fec=False, frame_size=0, state=None, out=None) -> (linear, state)\n\n"
+            "Convert the Opus encoded fragment to linear fragment and return this as a Python string.\n"
+            " fragment - the Opus packet, or an empty string to conceal a lost packet\n"
+            " fec - if set, recover the previous lost frame from the forward error correction data in this packet\n"
+            " frame_size - samples per channel to conceal or recover, by default the size of the last decoded frame")},
+#endif
+    {"pool_config", (PyCFunction) pyaudio_pool_config, METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("pool_config(max_idle)\n\n"
+            "Set the maximum number of idle states kept for reuse per state type and parameters, or 0 to disable pooling. "
+            "When enabled, a deallocated state is reset and kept in the pool, and a new state with the same type and parameters "
+            "reuses it instead of initializing a new one. Idle resampler banks are kept only as needed for max_idle channels. "
+            "Preprocess states are never pooled.")},
+    {"pool_warm", (PyCFunction) pyaudio_pool_warm, METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("pool_warm(kind, count, sample_rate=0, channels=1, frame_size=0, filter_length=0, input_rate=0, output_rate=0, quality=3, application=\"voip\") -> added:int\n\n"
+            "Pre-initialize up to count idle states in the pool, but no more than the max_idle set by pool_config.\n"
+            " kind - one of \"encoder\", \"decoder\" (with sample_rate), \"echo\" (with frame_size and filter_length), "
+            "\"preprocess\" (with frame_size and sample_rate, used once as the preprocessor cannot be reset), "
+            "\"resampler\" (with input_rate, output_rate and quality), \"opus_encoder\" or \"opus_decoder\" (with sample_rate and channels)")},
+    {"pool_stats", (PyCFunction) pyaudio_pool_stats, METH_NOARGS,
+        PyDoc_STR("pool_stats() -> dict\n\n"
+            "Get the max_idle setting, the number of idle states, and the hits, misses, returns and discards counts of the pool.")},
+    {"mix", (PyCFunction) pyaudio_mix, METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("mix(fragments, gains=None, decoders=None, encoders=None) -> (mixed, (output1, output2, ...))\n\n"
+            "Mix the linear fragments of all the participants of a conference in a single pass, and return the full mix along with "
+            "each participant's mix of everyone but itself.\n"
+            " fragments - sequence of linear fragments, one per participant, where shorter or empty fragments are padded with silence\n"
+            " gains - optional sequence of per-participant gain between -8 and 8 applied to its fragment before mixing\n"
+            " decoders - optional sequence of decoder states, one per participant, to first decode the Speex encoded fragments; "
+            "an empty fragment is concealed as a lost packet\n"
+            " encoders - optional sequence of encoder states, one per participant, to return the outputs as Speex encoded fragments; "
+            "the frame size of each encoder must match the mixed frame size")},
+#ifdef __linux__
+    {"transcode", (PyCFunction) pyaudio_transcode, METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("transcode(jobs, mode=\"encode\", container=\"ogg\", sample_rate=8000, input_rate=0, output_rate=0, quality=-1, resample_quality=5, threads=0) -> (results, stats)\n\n"
+            "Transcode whole files in parallel worker threads without holding the GIL, and return per-job results and overall throughput.\n"
+            " jobs - sequence of (input_path, output_path) tuples\n"
+            " mode - \"encode\" to convert 16-bit PCM WAV or raw linear input to Speex, or \"decode\" to convert Speex to mono WAV\n"
+            " container - \"ogg\" for Ogg Speex (.spx) files, or \"raw\" for concatenated Speex frames\n"
+            " sample_rate - Speex sample rate of 8000, 16000 or 32000 when encoding or decoding raw frames; Ogg files carry their own\n"
+            " input_rate - sample rate of raw linear input, since WAV input carries its own, and resampled to sample_rate if different\n"
+            " output_rate - optional sample rate of the decoded WAV output, if different from the Speex sample rate\n"
+            " quality - optional Speex encoder quality 0-10\n"
+            " resample_quality - resampler quality 0-10\n"
+            " threads - number of worker threads, default is the number of processors\n"
+            "Each result is a dict with input, output, duration and elapsed seconds, and error or None. The stats dict has the total "
+            "duration, elapsed seconds, and realtime_factor as the ratio of audio duration to elapsed time.")},
+    {"record", (PyCFunction) pyaudio_record, METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("record(fragment, path=None, sample_rate=8000, channels=1, format=\"wav\", quality=-1, ring_duration=2000, state=None) -> (dropped, state)\n\n"
+            "Queue the linear fragment for recording without blocking, where a background thread writes the file. "
+            "Returns the number of frames of this fragment dropped because the writer fell behind, which is 0 normally.\n"
+            " path - name of the file to create on the first call without state\n"
+            " sample_rate - sample rate of the fragments, which must be 8000, 16000 or 32000 for speex\n"
+            " channels - number of interleaved channels in the fragments, e.g., 2 for both directions of a call\n"
+            " format - \"wav\" for a WAV file, or \"speex\" for an Ogg Speex file of the downmixed channels\n"
+            " quality - optional Speex encoder quality 0-10\n"
+            " ring_duration - duration of the ring in ms, beyond which the fragments are dropped\n"
+            "The state has recorded and dropped attributes with the frame counts. Deleting the state or calling record_close "
+            "writes the queued frames and completes the file.")},
+    {"record_close", (PyCFunction) pyaudio_record_close, METH_VARARGS | METH_KEYWORDS,
+        PyDoc_STR("record_close(state)\n\n"
+            "Stop recording after writing all the queued frames, and complete the file.")},
+#endif
+        
+    {NULL, NULL, 0, NULL}  /* Sentinel */
+};
+
+
+PyMODINIT_FUNC
+initaudiospeex(void)
+{
+    PyObject *m;
+    
+    StateType.tp_new = PyType_GenericNew;
+    if (PyType_Ready(&StateType) < 0)
+        return;
+    
+    m = Py_InitModule3("audiospeex", Module_methods, "speex voice codec and quality engine based on the open source speex library\n\n"
+        "Fragment arguments may be any object supporting the buffer protocol, such as str, bytearray, memoryview or mmap, "
+        "and linear fragments may also be NumPy int16 or float32 arrays. If the out argument is given as a writable buffer, "
+        "the result is written to it instead of a new string, and its size in bytes is returned in place of the result.");
+    if (m == NULL)
+        return;
+
+    random_source = fopen("/dev/urandom", "rb");
+    if (random_source != NULL) {
+        setvbuf(random_source, NULL, _IONBF, 0); // so that a forked process does not repeat the buffered values
+    }
+    random_state = ((unsigned int) time(NULL) ^ ((unsigned int) getpid() << 16)) | 1;
+#ifdef __linux__
+    ogg_crc_init();
+#endif
+    
     ModuleError = PyErr_NewException((char*) "audiospeex.error", NULL, NULL);
     Py_INCREF(ModuleError);
     PyModule_AddObject(m, "error", ModuleError);
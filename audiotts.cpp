@@ -2,8 +2,12 @@
 #include <structmember.h>
 #include "arpa/inet.h"
 
+#include <vector>
+
 extern "C" {
     #include "flite.h"
+    #include "speex/speex.h"
+    #include "speex/speex_resampler.h"
     cst_voice *register_cmu_us_kal(const char*);
     cst_voice *register_cmu_us_awb(const char *voxdir);
     cst_voice *register_cmu_us_rms(const char *voxdir);
@@ -16,37 +20,123 @@ extern "C" {
 
 static PyObject *ModuleError;
 
+/* G.711 conversion tables indexed by the significant bits of a linear sample, i.e., 14 bits for
+   u-law and 13 bits for a-law, so that conversion is a branch free lookup per sample. */
+static unsigned char ulaw_table[1 << 14];
+static unsigned char alaw_table[1 << 13];
+
+static unsigned char
+linear2ulaw(int sample)
+{
+    static const int BIAS = 0x84, CLIP = 32635;
+    int sign = (sample >> 8) & 0x80;
+    if (sign)
+        sample = -sample;
+    if (sample > CLIP)
+        sample = CLIP;
+    sample += BIAS;
+    int exponent = 7;
+    for (int mask = 0x4000; (sample & mask) == 0 && exponent > 0; mask >>= 1)
+        --exponent;
+    int mantissa = (sample >> (exponent + 3)) & 0x0F;
+    return (unsigned char) ~(sign | (exponent << 4) | mantissa);
+}
+
+static unsigned char
+linear2alaw(int sample)
+{
+    int sign = sample >= 0 ? 0x80 : 0;
+    if (!sign)
+        sample = -sample - 1;
+    if (sample > 32767)
+        sample = 32767;
+    int exponent = 7;
+    for (int mask = 0x4000; (sample & mask) == 0 && exponent > 0; mask >>= 1)
+        --exponent;
+    int mantissa = exponent == 0 ? (sample >> 4) & 0x0F : (sample >> (exponent + 3)) & 0x0F;
+    return (unsigned char) ((sign | (exponent << 4) | mantissa) ^ 0x55);
+}
+
+static void
+g711_init()
+{
+    for (int i=0; i<(1 << 14); ++i)
+        ulaw_table[i] = linear2ulaw((i - (1 << 13)) << 2);
+    for (int i=0; i<(1 << 13); ++i)
+        alaw_table[i] = linear2alaw((i - (1 << 12)) << 3);
+}
+
+/* Resample the synthesized wave with the speex resampler, including the tail in its filter.
+   Return false if the resampler cannot be created. */
+static bool
+tts_resample(const short* input, int count, int input_rate, int output_rate, std::vector<short>& output)
+{
+    int err = 0;
+    SpeexResamplerState* resampler = speex_resampler_init(1, input_rate, output_rate, SPEEX_RESAMPLER_QUALITY_DEFAULT, &err);
+    if (resampler == NULL) {
+        return false;
+    }
+    speex_resampler_skip_zeros(resampler);
+    
+    output.resize((size_t) count * output_rate / input_rate + 2 * output_rate / 100 + 100);
+    spx_uint32_t input_size = count, output_size = output.size();
+    speex_resampler_process_int(resampler, 0, input, &input_size, &output[0], &output_size);
+    size_t total = output_size;
+    
+    std::vector<short> zeros(speex_resampler_get_input_latency(resampler), 0);
+    if (!zeros.empty()) {
+        input_size = zeros.size();
+        output_size = output.size() - total;
+        speex_resampler_process_int(resampler, 0, &zeros[0], &input_size, &output[total], &output_size);
+        total += output_size;
+    }
+    output.resize(total);
+    speex_resampler_destroy(resampler);
+    return true;
+}
+
 static PyObject*
 pyaudio_tts(PyObject* self, PyObject* args, PyObject* kwargs)
 {
-    const char* format_str = "l16"; // result will be in linear 16 format. Alternatives is ulaw
+    const char* format_str = "l16"; // result will be in linear 16 format. Alternatives are ulaw, alaw and speex
     int sample_rate = 8000;  // result will be in 8000 Hz
     int frame_duration = 20; // result will be multiple of 20 ms
     const char* name = "default"; // the name is currently ignored
     const char* text = NULL; // the text to convert
+    int quality = -1; // speex encoder quality, if set
     
     static const char *kwlist[] = {
-        "text", "format", "sample_rate", "frame_duration", "name",
+        "text", "format", "sample_rate", "frame_duration", "name", "quality",
     NULL};
     
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|siis", (char **)kwlist,
-            &text, &format_str, &sample_rate, &frame_duration, &name)) {
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|siisi", (char **)kwlist,
+            &text, &format_str, &sample_rate, &frame_duration, &name, &quality)) {
         return NULL;
     }
     
-    if (sample_rate != 8000 && sample_rate != 16000) {
-        PyErr_SetString(ModuleError, "invalid sample_rate argument, must be 8000 or 16000");
+    bool speex = strcmp(format_str, "speex") == 0;
+    if (strcmp(format_str, "l16") != 0 && strcmp(format_str, "ulaw") != 0 && strcmp(format_str, "alaw") != 0 && !speex) {
+        PyErr_SetString(ModuleError, "invalid format argument, must be \"l16\", \"ulaw\", \"alaw\" or \"speex\"");
         return NULL;
     }
     
-    if (strcmp(format_str, "l16") != 0 && strcmp(format_str, "ulaw") != 0) {
-        PyErr_SetString(ModuleError, "invalid format argument, must be \"l16\" or \"ulaw\"");
+    if (sample_rate != 8000 && sample_rate != 16000 && sample_rate != 32000) {
+        PyErr_SetString(ModuleError, "invalid sample_rate argument, must be 8000, 16000 or 32000");
+        return NULL;
+    }
+    
+    if (frame_duration <= 0 || (speex && frame_duration % 20 != 0)) {
+        PyErr_SetString(ModuleError, "invalid frame_duration argument, must be a multiple of 20 for speex");
+        return NULL;
+    }
+    
+    if (quality != -1 && (quality < 0 || quality > 10)) {
+        PyErr_SetString(ModuleError, "invalid quality argument, must be 0-10");
         return NULL;
     }
     
     cst_wave *wave;
     cst_voice *voice;
-    int i, nsamples;
     
     if (strcmp(name, "default") == 0) {
         voice = flite_voice_select(NULL);
@@ -61,55 +151,112 @@ pyaudio_tts(PyObject* self, PyObject* args, PyObject* kwargs)
     }
     
     wave = flite_text_to_wave(text, voice);
+    if (wave == NULL) {
+        PyErr_SetString(ModuleError, "failed to convert text to speech");
+        return NULL;
+    }
     
-    if (sample_rate != wave->sample_rate) {
-        cst_wave_resample(wave, sample_rate);
+    const short* samples = wave->samples;
+    int nsamples = wave->num_samples;
+    std::vector<short> resampled;
+    if (sample_rate != wave->sample_rate && nsamples > 0) {
+        if (!tts_resample(wave->samples, nsamples, wave->sample_rate, sample_rate, resampled)) {
+            delete_wave(wave);
+            PyErr_SetString(ModuleError, "failed to create resampler state");
+            return NULL;
+        }
+        samples = resampled.empty() ? NULL : &resampled[0];
+        nsamples = resampled.size();
     }
     
-    nsamples = wave->num_samples;
-    int sample_size = strcmp(format_str, "l16") == 0 ? 2 : 1;
+    // pad the result with silence to a multiple of frame duration
     int frame_samples = sample_rate * frame_duration / 1000;
+    int total = (nsamples + frame_samples - 1) / frame_samples * frame_samples;
+    PyObject* output = NULL;
     
-    if ((wave->num_samples % frame_samples) != 0) {
-        frame_samples = wave->num_samples + frame_samples - (wave->num_samples % frame_samples);
-    }
-    else {
-        frame_samples = wave->num_samples;
-    }
-    
-    char* data = (char*) calloc(sample_size, frame_samples);
-    if (strcmp(format_str, "l16") == 0) {
-        for (i=0; i<wave->num_samples; ++i) {
-            ((short *) data)[i] = wave->samples[i];
+    if (speex) {
+        std::vector<short> padded(samples, samples + nsamples);
+        padded.resize(total, 0);
+        
+        const SpeexMode* mode = sample_rate == 8000 ? &speex_nb_mode : (sample_rate == 16000 ? &speex_wb_mode : &speex_uwb_mode);
+        void* encoder = speex_encoder_init(mode);
+        if (encoder == NULL) {
+            delete_wave(wave);
+            PyErr_SetString(ModuleError, "failed to create encoder state");
+            return NULL;
+        }
+        if (quality >= 0) {
+            speex_encoder_ctl(encoder, SPEEX_SET_QUALITY, &quality);
         }
-        for (i=wave->num_samples; i<frame_samples; ++i) {
-            ((short *) data)[i] = 0;
+        int speex_frame_size = 0;
+        speex_encoder_ctl(encoder, SPEEX_GET_FRAME_SIZE, &speex_frame_size);
+        SpeexBits bits;
+        speex_bits_init(&bits);
+        
+        // each item has the encoded speex frames of one frame duration
+        output = PyList_New(total / frame_samples);
+        for (int i=0; output != NULL && i<total / frame_samples; ++i) {
+            speex_bits_reset(&bits);
+            for (int j=0; j<frame_samples; j+=speex_frame_size) {
+                speex_encode_int(encoder, &padded[i * frame_samples + j], &bits);
+            }
+            int size = speex_bits_nbytes(&bits);
+            PyObject* item = PyString_FromStringAndSize(NULL, size);
+            if (item == NULL) {
+                Py_CLEAR(output);
+                break;
+            }
+            speex_bits_write(&bits, PyString_AS_STRING(item), size);
+            PyList_SET_ITEM(output, i, item);
         }
+        speex_bits_destroy(&bits);
+        speex_encoder_destroy(encoder);
     }
-    else if (strcmp(format_str, "ulaw") == 0) {
-        for (i=0; i<wave->num_samples; ++i) {
-            data[i] = cst_short_to_ulaw(wave->samples[i]);
+    else if (strcmp(format_str, "l16") == 0) {
+        output = PyString_FromStringAndSize(NULL, total * 2);
+        if (output != NULL) {
+            short* data = (short*) PyString_AS_STRING(output);
+            if (nsamples > 0) {
+                memcpy(data, samples, nsamples * 2);
+            }
+            memset(data + nsamples, 0, (total - nsamples) * 2);
         }
-        for (i=wave->num_samples; i<frame_samples; ++i) {
-            ((short *) data)[i] = cst_short_to_ulaw(0);
+    }
+    else {
+        bool ulaw = strcmp(format_str, "ulaw") == 0;
+        const unsigned char* table = ulaw ? ulaw_table : alaw_table;
+        int shift = ulaw ? 2 : 3;
+        int offset = ulaw ? 1 << 13 : 1 << 12;
+        
+        output = PyString_FromStringAndSize(NULL, total);
+        if (output != NULL) {
+            unsigned char* data = (unsigned char*) PyString_AS_STRING(output);
+            for (int i=0; i<nsamples; ++i) {
+                data[i] = table[(samples[i] >> shift) + offset];
+            }
+            memset(data + nsamples, table[offset], total - nsamples);
         }
     }
     
-    PyObject* output = PyString_FromStringAndSize(data, frame_samples * sample_size);
-    free(data);
+    delete_wave(wave);
+    if (output == NULL) {
+        return NULL;
+    }
     return Py_BuildValue("N", output);
 }
 
 
 static PyMethodDef Module_methods[] = {
     {"convert", (PyCFunction) pyaudio_tts, METH_VARARGS | METH_KEYWORDS,
-        PyDoc_STR("convert(text, format=\"l16\", sample_rate=8000, frame_duration=20, name='default') -> samples\n\n"
+        PyDoc_STR("convert(text, format=\"l16\", sample_rate=8000, frame_duration=20, name='default', quality=-1) -> samples\n\n"
             "Convert the given text to speech samples in the given format and sample rate using the given voice name and assuming given frame duration.\n"
             " text - a string that is converted to the returned speech samples\n"
-            " format - format for returned speech samples is one of \"l16\" or \"ulaw\"\n"
-            " sample_rate - sampling rate to use for returned speech samples in Hz and is one of 8000 or 16000\n"
-            " frame_duration - frame duration for capture and playback in ms\n"
-            " name - name of the voice to use for conversion can be one of \"kal\" (male, default), \"rms\" (male), \"slt\" (female), \"awb\" (scottish male)\n")},
+            " format - format for returned speech samples is one of \"l16\", \"ulaw\", \"alaw\", or \"speex\" which returns "
+            "a list of Speex encoded frames, one per frame duration, ready to send\n"
+            " sample_rate - sampling rate to use for returned speech samples in Hz and is one of 8000, 16000 or 32000\n"
+            " frame_duration - frame duration for capture and playback in ms, and must be a multiple of 20 for speex\n"
+            " name - name of the voice to use for conversion can be one of \"kal\" (male, default), \"rms\" (male), \"slt\" (female), \"awb\" (scottish male)\n"
+            " quality - optional Speex encoder quality 0-10\n")},
     {NULL, NULL, 0, NULL}  /* Sentinel */
 };
 
@@ -124,6 +271,7 @@ initaudiotts(void)
         return;
 
     flite_init();
+    g711_init();
     
     flite_voice_list = cons_val(voice_val(register_cmu_us_kal(NULL)),flite_voice_list);
     flite_voice_list = cons_val(voice_val(register_cmu_us_awb(NULL)),flite_voice_list);
@@ -0,0 +1,78 @@
+#!/usr/bin/env python
+
+import sys, time, struct, math, resource, traceback
+from optparse import OptionParser
+try:
+    import audiospeex
+except:
+    print 'cannot load audiospeex.so, please set the PYTHONPATH'
+    traceback.print_exc()
+    sys.exit(-1)
+
+parser = OptionParser(usage='%prog [options]\n\n'
+                      'Measure the memory and time of many resampler states with the same rates, e.g.,\n'
+                      '  python resample.py -n 500 -i 8000 -o 48000 -q 3\n'
+                      'Run it with the PYTHONPATH of each audiospeex build to compare them.')
+parser.add_option('-n', '--states', type='int', default=500, help='number of resampler states, default 500')
+parser.add_option('-i', '--input-rate', type='int', default=8000, help='input sample rate, default 8000')
+parser.add_option('-o', '--output-rate', type='int', default=48000, help='output sample rate, default 48000')
+parser.add_option('-q', '--quality', type='int', default=3, help='resampler quality 0-10, default 3')
+parser.add_option('-f', '--frames', type='int', default=50, help='number of 20 ms frames per state, default 50')
+options, args = parser.parse_args()
+
+def rss():
+    '''Return the resident memory in KB.'''
+    try:
+        for line in open('/proc/self/status'):
+            if line.startswith('VmRSS:'):
+                return int(line.split()[1])
+    except IOError:
+        pass
+    return resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+
+size = options.input_rate / 50
+frame = struct.pack('<%dh'%(size,), *[int(8000 * math.sin(2 * math.pi * 440 * i / options.input_rate)) for i in range(size)])
+kwargs = dict(input_rate=options.input_rate, output_rate=options.output_rate, quality=options.quality)
+
+def create(count):
+    states = []
+    for i in range(count):
+        fragment, state = audiospeex.resample(frame, **kwargs)
+        states.append(state)
+    return states
+
+# warm up at other rates, then a single state, which must not cost more than a plain resampler
+fragment, state = audiospeex.resample(frame, input_rate=options.input_rate, output_rate=options.input_rate * 2)
+del state
+before = rss()
+start = time.time()
+single = create(1)
+single_setup = time.time() - start
+single_memory = rss() - before
+del single
+
+before = rss()
+start = time.time()
+states = create(options.states)
+setup = time.time() - start
+memory = rss() - before
+
+start = time.time()
+for i in range(options.frames - 1):
+    for j in range(len(states)):
+        fragment, states[j] = audiospeex.resample(frame, state=states[j], **kwargs)
+process = time.time() - start
+
+# call churn, replacing half of the states
+start = time.time()
+del states[:len(states) / 2]
+states.extend(create(options.states / 2))
+churn = time.time() - start
+
+print '%d Hz to %d Hz at quality %d'%(options.input_rate, options.output_rate, options.quality)
+print 'single state: %.1f us setup, %d KB'%(single_setup * 1e6, single_memory)
+print '%d states: %.1f us setup per state, %.2f KB per state'%(options.states, setup * 1e6 / options.states, float(memory) / options.states)
+print 'resampling: %.2f us per 20 ms frame'%(process * 1e6 / (options.states * max(options.frames - 1, 1)),)
+print 'churn: %.1f us per replaced state'%(churn * 1e6 / max(options.states / 2, 1),)
+if hasattr(audiospeex, 'resampler_stats'):
+    print 'banks:', audiospeex.resampler_stats()
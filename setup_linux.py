@@ -1,22 +1,26 @@
 from distutils.core import setup, Extension
+import os
+
+# build audiospeex with the optional Opus codec only if pkg-config finds libopus
+has_opus = os.system('pkg-config --exists opus 2>/dev/null') == 0
 
-module1 = Extension('audiodev', sources = ['audiodev.cpp'],
+module1 = Extension('audiodev', sources = ['audiodev.cpp'], depends = ['audiorecord.h', 'audiolevel.h'],
                     include_dirs = ['rtaudio'],
                     libraries = ['pthread', 'asound'], extra_link_args = ['rtaudio/librtaudio.a'])
-module2 = Extension('audiospeex', sources = ['audiospeex.cpp'],
+module2 = Extension('audiospeex', sources = ['audiospeex.cpp'], depends = ['audiorecord.h', 'audiolevel.h'],
                     include_dirs = ['speex/include'],
                     library_dirs = ['speex/libspeex/.libs'],
-                    libraries = ['speex', 'speexdsp'], extra_link_args = ['-fPIC'])
+                    define_macros = [('HAVE_OPUS', '1')] if has_opus else [],
+                    libraries = ['pthread', 'speex', 'speexdsp'] + (['opus'] if has_opus else []), extra_link_args = ['-fPIC'])
 
-import os
 # libdir = 'flite/build/x86_64-linux-gnu'
 
 
 module3 = Extension('audiotts', sources = ['audiotts.cpp'],
-                    include_dirs = ['flite/include'],
-                    library_dirs = ['flite/build/x86_64-linux-gnu/lib'],
+                    include_dirs = ['flite/include', 'speex/include'],
+                    library_dirs = ['flite/build/x86_64-linux-gnu/lib', 'speex/libspeex/.libs'],
                     libraries = ['flite_cmu_us_kal', 'flite_cmu_us_awb', 'flite_cmu_us_rms', 'flite_cmu_us_slt',
-                    			 'flite_usenglish', 'flite_cmulex', 'flite'],
+                    			 'flite_usenglish', 'flite_cmulex', 'flite', 'speex', 'speexdsp'],
                     extra_link_args = ['-fPIC'])
 
 setup (name = 'PackageName', version = '1.0',
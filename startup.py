@@ -0,0 +1,40 @@
+#!/usr/bin/env python
+
+import sys, subprocess
+from optparse import OptionParser
+
+parser = OptionParser(usage='%prog [options]\n\n'
+                      'Time "import audiodev" and its first device listing, each in a new Python process, e.g.,\n'
+                      '  PYTHONPATH=build/lib python startup.py -n 20\n'
+                      'Run it with the PYTHONPATH of each audiodev build to compare them.')
+parser.add_option('-n', '--runs', type='int', default=20, help='number of processes, default 20')
+options, args = parser.parse_args()
+
+# the child prints the import time, and the time of the first get_devices, which creates RtAudio
+child = '''
+import time
+start = time.time()
+import audiodev
+imported = time.time()
+audiodev.get_devices()
+print imported - start, time.time() - imported
+'''
+
+imports, listings = [], []
+for i in range(options.runs):
+    process = subprocess.Popen([sys.executable, '-c', child], stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    output, error = process.communicate()
+    if process.returncode != 0:
+        print 'cannot load audiodev.so, please set the PYTHONPATH'
+        print error
+        sys.exit(-1)
+    first, second = output.split()
+    imports.append(float(first))
+    listings.append(float(second))
+
+def report(name, values):
+    values = sorted(values)
+    print '%s: min %.2f ms, median %.2f ms, max %.2f ms'%(name, values[0] * 1000, values[len(values) / 2] * 1000, values[-1] * 1000)
+
+report('import audiodev', imports)
+report('first get_devices', listings)
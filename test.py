@@ -5,7 +5,144 @@ except:
     print 'cannot load audiodev.so and audiospeex.so, please set the PYTHONPATH'
     traceback.print_exc()
     sys.exit(-1)
-    
+
+# relay loopback: run as "python test.py relay" to send RTP from a 8000 Hz socket through
+# the native relay to a 16000 Hz socket on localhost, without using any audio device
+
+if len(sys.argv) > 1 and sys.argv[1] == 'relay':
+    import socket, math, struct
+    sock_a = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock_b = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock_b.bind(('127.0.0.1', 0))
+
+    audiospeex.relay_start(threads=1)
+    try:
+        id, port_a, port_b = audiospeex.relay_add(('127.0.0.1', 0), None, 8000, ('127.0.0.1', 0), sock_b.getsockname(), 16000)
+        enc = dec = None
+        received = 0
+        for i in range(50):
+            fragment = ''.join(struct.pack('<h', int(8000 * math.sin(2 * math.pi * 440 * (i * 160 + j) / 8000.0))) for j in range(160))
+            packet, enc = audiospeex.lin2rtp(fragment, sample_rate=8000, state=enc)
+            sock_a.sendto(packet, ('127.0.0.1', port_a))
+            sock_b.settimeout(0.05 if i < 49 else 1.0) # wait longer for the last packets
+            try:
+                while True:
+                    data = sock_b.recv(1500)
+                    linear, dec = audiospeex.rtp2lin(data, sample_rate=16000, state=dec)
+                    received += len(linear) / 2
+            except socket.timeout:
+                pass
+        print 'relay received %d samples at 16000 Hz'%(received,), audiospeex.relay_stats(id)
+        audiospeex.relay_remove(id)
+    finally:
+        audiospeex.relay_stop()
+    sys.exit(0 if received > 0 else -1)
+
+# mixer check: run as "python test.py mix" to verify the conference mix and its gain validation
+
+if len(sys.argv) > 1 and sys.argv[1] == 'mix':
+    import struct
+    a, b = struct.pack('<160h', *([1000] * 160)), struct.pack('<160h', *([-300] * 160))
+    mixed, (out_a, out_b) = audiospeex.mix([a, b])
+    assert mixed == struct.pack('<160h', *([700] * 160)) and out_a == b and out_b == a
+    loud = struct.pack('<160h', *([3000] * 160))
+    mixed, outputs = audiospeex.mix([loud, loud], gains=[8.0, 8.0])
+    assert mixed == struct.pack('<160h', *([32767] * 160)), 'saturate'
+    for gains in ([float('nan'), 1.0], [8.5, 1.0], [float('-inf'), 1.0]):
+        try:
+            audiospeex.mix([a, b], gains=gains)
+            assert False, 'invalid gains %r accepted'%(gains,)
+        except audiospeex.error:
+            pass
+    print 'mix ok'
+    sys.exit(0)
+
+# opus round trip: run as "python test.py opus" to encode and decode a tone, and conceal a lost packet
+
+if len(sys.argv) > 1 and sys.argv[1] == 'opus':
+    import math, struct
+    if not hasattr(audiospeex, 'lin2opus'):
+        print 'opus not built in audiospeex'
+        sys.exit(-1)
+    enc = dec = None
+    sent = received = 0.0
+    for i in range(50):
+        samples = [int(8000 * math.sin(2 * math.pi * 440 * (i * 960 + j) / 48000.0)) for j in range(960)]
+        packet, enc = audiospeex.lin2opus(struct.pack('<960h', *samples), sample_rate=48000, state=enc)
+        linear, dec = audiospeex.opus2lin(packet, sample_rate=48000, state=dec)
+        assert len(linear) == 960 * 2, 'decoded %d bytes'%(len(linear),)
+        if i >= 10: # after the codec delay
+            sent += sum(x * x for x in samples)
+            received += sum(x * x for x in struct.unpack('<960h', linear))
+    assert 0.5 < received / sent < 2.0, 'energy ratio %g'%(received / sent,)
+    linear, dec = audiospeex.opus2lin('', state=dec) # lost packet
+    assert len(linear) == 960 * 2, 'concealed %d bytes'%(len(linear),)
+    print 'opus ok'
+    sys.exit(0)
+
+# rtp loss check: run as "python test.py rtp" to verify the lost and late packet counts under reordering
+
+if len(sys.argv) > 1 and sys.argv[1] == 'rtp':
+    enc = dec = None
+    packets = []
+    for i in range(10):
+        packet, enc = audiospeex.lin2rtp('\x00\x00' * 160, sample_rate=8000, state=enc)
+        packets.append(packet)
+    for i in (0, 1, 3, 2, 4, 4, 7, 8, 9): # 2 and 3 swapped, 4 duplicated, 5 and 6 lost
+        linear, dec = audiospeex.rtp2lin(packets[i], sample_rate=8000, state=dec)
+    assert dec.received == 9 and dec.late == 2, (dec.received, dec.late)
+    assert dec.lost == 2 and dec.sequence == (enc.sequence - 1) & 0xffff, (dec.lost, dec.sequence)
+    print 'rtp ok'
+    sys.exit(0)
+
+# pool check: run as "python test.py pool" to verify that released states are reused from the pool
+
+if len(sys.argv) > 1 and sys.argv[1] == 'pool':
+    silence = '\x00\x00' * 160
+    audiospeex.pool_config(max_idle=4)
+    assert audiospeex.pool_warm('encoder', 2, sample_rate=8000) == 2
+    assert audiospeex.pool_warm('preprocess', 1, frame_size=160, sample_rate=8000) == 1
+    stats = audiospeex.pool_stats()
+    encoded, enc = audiospeex.lin2speex(silence, sample_rate=8000)
+    linear, pre = audiospeex.preprocess(silence, frame_size=160, sampling_rate=8000)
+    linear, echo = audiospeex.cancel_echo(silence, silence, frame_size=160, filter_length=800)
+    linear, echo = audiospeex.cancel_echo(silence, silence, state=echo)
+    assert audiospeex.pool_stats()['hits'] == stats['hits'] + 2, audiospeex.pool_stats()
+    del enc, pre, echo # the encoder and echo states are reset and returned, the used preprocess state is not
+    stats = audiospeex.pool_stats()
+    encoded, enc = audiospeex.lin2speex(silence, sample_rate=8000)
+    linear, echo = audiospeex.cancel_echo(silence, silence, frame_size=160, filter_length=800)
+    assert audiospeex.pool_stats()['hits'] == stats['hits'] + 2, audiospeex.pool_stats()
+    del enc, echo
+    audiospeex.pool_config(max_idle=0)
+    assert audiospeex.pool_stats()['idle'] == 0
+    print 'pool ok'
+    sys.exit(0)
+
+# G.711 check: run as "python test.py g711" to compare the u-law and a-law output of audiotts with audioop
+
+if len(sys.argv) > 1 and sys.argv[1] == 'g711':
+    import audioop
+    try:
+        import audiotts
+    except:
+        print 'cannot load audiotts.so, please set the PYTHONPATH'
+        traceback.print_exc()
+        sys.exit(-1)
+    text = 'all the quick brown foxes jump over the lazy dog'
+    linear = audiotts.convert(text, format='l16', sample_rate=8000)
+    for format, convert in (('ulaw', audioop.lin2ulaw), ('alaw', audioop.lin2alaw)):
+        encoded = audiotts.convert(text, format=format, sample_rate=8000)
+        assert encoded == convert(linear, 2), '%s differs from audioop'%(format,)
+    for quality in (-2, 11):
+        try:
+            audiotts.convert(text, format='speex', quality=quality)
+            assert False, 'invalid quality %d accepted'%(quality,)
+        except audiotts.error:
+            pass
+    print 'g711 ok'
+    sys.exit(0)
+
 # capabilities
 
 print audiodev.get_api_name()
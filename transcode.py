@@ -0,0 +1,42 @@
+#!/usr/bin/env python
+
+import sys, traceback
+from optparse import OptionParser
+try:
+    import audiospeex
+except:
+    print 'cannot load audiospeex.so, please set the PYTHONPATH'
+    traceback.print_exc()
+    sys.exit(-1)
+
+parser = OptionParser(usage='%prog [options] input output [input output ...]\n\n'
+                      'Encode WAV or raw linear files to Speex, or decode Speex files to WAV, e.g.,\n'
+                      '  python transcode.py call1.wav call1.spx call2.wav call2.spx\n'
+                      '  python transcode.py -d call1.spx call1.wav')
+parser.add_option('-d', '--decode', action='store_true', default=False, help='decode Speex to WAV instead of encoding')
+parser.add_option('-r', '--raw', action='store_true', default=False, help='use raw Speex frames instead of Ogg Speex files')
+parser.add_option('-s', '--sample-rate', type='int', default=8000, help='Speex sample rate of 8000, 16000 or 32000, default 8000')
+parser.add_option('-i', '--input-rate', type='int', default=0, help='sample rate of raw linear input files')
+parser.add_option('-o', '--output-rate', type='int', default=0, help='sample rate of decoded WAV files')
+parser.add_option('-q', '--quality', type='int', default=-1, help='Speex encoder quality 0-10')
+parser.add_option('-t', '--threads', type='int', default=0, help='number of worker threads, default is the number of processors')
+options, args = parser.parse_args()
+
+if not args or len(args) % 2 != 0:
+    parser.error('supply pairs of input and output files')
+
+jobs = zip(args[0::2], args[1::2])
+results, stats = audiospeex.transcode(jobs, mode='decode' if options.decode else 'encode',
+                                      container='raw' if options.raw else 'ogg', sample_rate=options.sample_rate,
+                                      input_rate=options.input_rate, output_rate=options.output_rate,
+                                      quality=options.quality, threads=options.threads)
+
+failed = 0
+for result in results:
+    if result['error']:
+        failed += 1
+        print '%s: error: %s'%(result['input'], result['error'])
+    else:
+        print '%s -> %s: %.1f s in %.3f s'%(result['input'], result['output'], result['duration'], result['elapsed'])
+print 'total %.1f s of audio in %.3f s, %.1fx realtime'%(stats['duration'], stats['elapsed'], stats['realtime_factor'])
+sys.exit(1 if failed else 0)